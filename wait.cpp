@@ -8,9 +8,30 @@
 
 #include <windows.h>
 #include <tlhelp32.h>
+#include <dbt.h>
 #include <errno.h>
 #include <string>
 #include <vector>
+#include <algorithm>
+
+// static trace points, build with WAIT_TRACELOGGING to trace the program with ETW
+#ifdef WAIT_TRACELOGGING
+   #include <TraceLoggingProvider.h>
+
+   TRACELOGGING_DEFINE_PROVIDER(
+      waitProvider, 
+      "Wait", 
+      (0xd6356c9e, 0xe7f2, 0x4d89, 0xbb, 0xbc, 0x3f, 0x97, 0xd8, 0x79, 0xb6, 0xcf)
+   );
+
+   #define WAIT_PROBE_REGISTER()       TraceLoggingRegister(waitProvider)
+   #define WAIT_PROBE_UNREGISTER()     TraceLoggingUnregister(waitProvider)
+   #define WAIT_PROBE(name, value)     TraceLoggingWrite(waitProvider, name, TraceLoggingUInt64(static_cast<ULONGLONG>(value), "Value"))
+#else
+   #define WAIT_PROBE_REGISTER()
+   #define WAIT_PROBE_UNREGISTER()
+   #define WAIT_PROBE(name, value)
+#endif
 
 // special return codes
 #define RETURNCODE_SIGINT     (-1)
@@ -19,12 +40,24 @@
 #define RETURNCODE_SHUTDOWN   (-4)
 #define RETURNCODE_HELP       (-5)
 #define RETURNCODE_ERROR      (-6)
+#define RETURNCODE_UNSATISFIED (-7)
 
 // command line parser states
 #define ARGSTATE_NONE         (0)
 #define ARGSTATE_DELTA        (1)
 #define ARGSTATE_TIME         (2)
 #define ARGSTATE_PROCESS      (3)
+#define ARGSTATE_EXPRESSION   (4)
+#define ARGSTATE_SIGNAL       (5)
+#define ARGSTATE_NOTIFY       (6)
+#define ARGSTATE_LOCK         (7)
+#define ARGSTATE_MOUNT        (8)
+#define ARGSTATE_UNMOUNT      (9)
+#define ARGSTATE_DEVICE       (10)
+#define ARGSTATE_RUNNING      (11)
+
+// invalid node index
+#define NO_NODE               ((size_t)-1)
 
 // time interval constant (unit is 100 nanoseconds)
 #define ONE_MILLISECOND       (10000)
@@ -33,11 +66,41 @@
 #define ONE_HOUR              (60 * (ULONGLONG)ONE_MINUTE)
 #define ONE_DAY               (24 * (ULONGLONG)ONE_HOUR)
 
+// signal event value for named kernel events
+#define SIGNAL_NAMED          ((ULONGLONG)-1)
+
+// notify event conditions
+#define NOTIFY_READY          (0x0001)
+#define NOTIFY_STATUS         (0x0002)
+#define NOTIFY_ERRNO          (0x0004)
+#define NOTIFY_EXTERNAL       (0x0100)    // the service is not launched by wait
+
+// lock event flags
+#define LOCK_HOLD             (0x0001)    // the lock is kept till the program exit
+#define LOCK_DONE             (0x0002)    // the lock request is completed and seen
+#define LOCK_OWNED            (0x0004)    // the lock is acquired and kept
+
+// maximum size of notify message
+#define NOTIFY_BUFFER_SIZE    (4096)
+
+// time given to the main thread to finish when the process is going to be terminated (milliseconds)
+#define CTRL_EXIT_TIMEOUT     (4000)
+
+// recheck interval of mount points which parent directory cannot be watched (milliseconds)
+#define WATCH_RECHECK_INTERVAL (1000)
+
 // event type
 enum eventType {
    EVENT_TIMEDELTA   = 0,
    EVENT_TIME,
-   EVENT_PROCESS
+   EVENT_PROCESS,
+   EVENT_SIGNAL,
+   EVENT_NOTIFY,
+   EVENT_LOCK,
+   EVENT_MOUNT,
+   EVENT_UNMOUNT,
+   EVENT_DEVICE,
+   EVENT_RUNNING
 };
 
 // event data structure
@@ -46,10 +109,16 @@ typedef struct eventData {
    std::wstring   text;
    ULONGLONG      data;
    HANDLE         handle;
+   HANDLE         failure;       // signaled when the event can no longer occur
+   HANDLE         object;        // kernel object behind the handle
+   OVERLAPPED     overlapped;
+   std::vector<char> buffer;
+   size_t         node;
    
    eventData(eventType _type, const wchar_t* _text, ULONGLONG _data)
-      : type(_type), text(_text), data(_data), handle(NULL)
+      : type(_type), text(_text), data(_data), handle(NULL), failure(NULL), object(NULL), node(NO_NODE)
    {
+      memset(&overlapped, 0, sizeof(OVERLAPPED));
    }
 } eventData;
 
@@ -57,6 +126,115 @@ typedef struct eventData {
 typedef std::vector<eventData>   eventVector;
 typedef std::vector<size_t>      indexVector;
 
+// expression node type
+enum nodeType {
+   NODE_EVENT        = 0,
+   NODE_AND,
+   NODE_OR,
+   NODE_NOT
+};
+
+// expression node state
+enum nodeState {
+   STATE_PENDING     = 0,
+   STATE_TRUE,
+   STATE_FALSE
+};
+
+// expression node structure, the state is final while the value is the current one:
+// the negation is true till its operand occurs, so the value can change back
+typedef struct nodeData {
+   nodeType       type;
+   nodeState      state;
+   bool           value;
+   size_t         event;         // event index, NODE_EVENT only
+   indexVector    children;
+   indexVector    parents;
+   size_t         valueCount;    // children with true value
+   size_t         trueCount;     // children decided as true
+   size_t         falseCount;    // children decided as false
+   size_t         liveParents;   // number of links from active parents
+   bool           active;        // node still can change the result
+   
+   nodeData(nodeType _type, size_t _event)
+      : type(_type), state(STATE_PENDING), value(false), event(_event), valueCount(0), 
+        trueCount(0), falseCount(0), liveParents(0), active(true)
+   {
+   }
+} nodeData;
+
+// expression node list, the nodes are linked into DAG
+typedef std::vector<nodeData>    nodeVector;
+
+// expression event prefix
+typedef struct eventPrefix {
+   const wchar_t* name;
+   eventType      type;
+} eventPrefix;
+
+const eventPrefix eventPrefixes[] = {
+   { L"d",        EVENT_TIMEDELTA },
+   { L"delta",    EVENT_TIMEDELTA },
+   { L"t",        EVENT_TIME },
+   { L"time",     EVENT_TIME },
+   { L"p",        EVENT_PROCESS },
+   { L"process",  EVENT_PROCESS },
+   { L"s",        EVENT_SIGNAL },
+   { L"signal",   EVENT_SIGNAL },
+   { L"n",        EVENT_NOTIFY },
+   { L"notify",   EVENT_NOTIFY },
+   { L"l",        EVENT_LOCK },
+   { L"lock",     EVENT_LOCK },
+   { L"m",        EVENT_MOUNT },
+   { L"mount",    EVENT_MOUNT },
+   { L"u",        EVENT_UNMOUNT },
+   { L"unmount",  EVENT_UNMOUNT },
+   { L"v",        EVENT_DEVICE },
+   { L"device",   EVENT_DEVICE },
+   { L"r",        EVENT_RUNNING },
+   { L"running",  EVENT_RUNNING }
+};
+
+// notify event condition name
+typedef struct notifyCondition {
+   const wchar_t* name;
+   ULONGLONG      condition;
+} notifyCondition;
+
+const notifyCondition notifyConditions[] = {
+   { L"ready",    NOTIFY_READY },
+   { L"status",   NOTIFY_STATUS },
+   { L"errno",    NOTIFY_ERRNO }
+};
+
+// console control signal name
+typedef struct signalName {
+   const wchar_t* name;
+   DWORD          ctrlType;
+} signalName;
+
+const signalName signalNames[] = {
+   { L"int",      CTRL_C_EVENT },
+   { L"sigint",   CTRL_C_EVENT },
+   { L"break",    CTRL_BREAK_EVENT },
+   { L"sigbreak", CTRL_BREAK_EVENT },
+   { L"close",    CTRL_CLOSE_EVENT },
+   { L"hup",      CTRL_CLOSE_EVENT },
+   { L"sighup",   CTRL_CLOSE_EVENT },
+   { L"logoff",   CTRL_LOGOFF_EVENT },
+   { L"shutdown", CTRL_SHUTDOWN_EVENT },
+   { L"term",     CTRL_SHUTDOWN_EVENT },
+   { L"sigterm",  CTRL_SHUTDOWN_EVENT }
+};
+
+// expression parser context
+typedef struct exprContext {
+   const wchar_t*    ptr;
+   const SYSTEMTIME* current;
+   eventVector*      events;
+   nodeVector*       nodes;
+} exprContext;
+
 // process info structure
 typedef struct processInfo {
    DWORD          id;
@@ -70,6 +248,131 @@ typedef struct processInfo {
 // process list
 typedef std::vector<processInfo> processVector;
 
+// watched mount point or device
+typedef struct watchItem {
+   eventType      type;
+   std::wstring   path;          // normalized path or device name
+   std::wstring   parent;        // directory containing the mount point, empty for drive root
+   DWORD          drive;         // logical drive mask of the path
+   HANDLE         event;
+   bool           state;         // last known state of the condition
+   
+   watchItem(eventType _type, HANDLE _event)
+      : type(_type), drive(0), event(_event), state(false)
+   {
+   }
+} watchItem;
+
+typedef std::vector<watchItem>   watchVector;
+
+// mount points and devices watcher, the thread keeps cached state of the watched
+// items and rechecks only items affected by the change notification
+typedef struct deviceWatcher {
+   watchVector    items;
+   DWORD          drives;        // cached logical drives mask
+   HANDLE         thread;
+   HANDLE         stop;
+   HANDLE         ready;         // signaled when the notifications are set
+} deviceWatcher;
+
+// user32 functions of the watcher window, the library is loaded only when items 
+// are watched since the console program with user32 gets no logoff and shutdown signals
+typedef struct windowFunctions {
+   HMODULE        module;
+   ATOM           (WINAPI *registerClass)(const WNDCLASSW* wc);
+   HWND           (WINAPI *createWindow)(DWORD exStyle, LPCWSTR className, LPCWSTR windowName, DWORD style, 
+                     int x, int y, int width, int height, HWND parent, HMENU menu, HINSTANCE instance, LPVOID param);
+   BOOL           (WINAPI *destroyWindow)(HWND window);
+   LRESULT        (WINAPI *defWindowProc)(HWND window, UINT message, WPARAM wParam, LPARAM lParam);
+   HDEVNOTIFY     (WINAPI *registerNotification)(HANDLE recipient, LPVOID filter, DWORD flags);
+   BOOL           (WINAPI *unregisterNotification)(HDEVNOTIFY notify);
+   DWORD          (WINAPI *msgWait)(DWORD count, const HANDLE* handles, BOOL waitAll, DWORD timeout, DWORD wakeMask);
+   BOOL           (WINAPI *peekMessage)(MSG* msg, HWND window, UINT filterMin, UINT filterMax, UINT remove);
+   LRESULT        (WINAPI *dispatchMessage)(const MSG* msg);
+} windowFunctions;
+
+struct systemInterface;
+
+struct runningData;
+
+// counted process, the exit callback marks it exited
+typedef struct runningProcess {
+   runningData*   data;
+   DWORD          id;
+   HANDLE         process;
+   HANDLE         wait;
+   volatile LONG  exited;
+   
+   runningProcess(runningData* _data, DWORD _id, HANDLE _process)
+      : data(_data), id(_id), process(_process), wait(NULL), exited(0)
+   {
+   }
+} runningProcess;
+
+typedef std::vector<runningProcess*> runningProcessVector;
+
+// running processes counter, decremented by the exit callback when a counted process exits
+typedef struct runningData {
+   volatile LONG  count;
+   LONG           limit;
+   HANDLE         event;
+   std::wstring   name;          // image file name
+   const systemInterface* sys;
+   runningProcessVector processes;
+   
+   runningData(LONG _limit, HANDLE _event, const systemInterface* _sys)
+      : count(0), limit(_limit), event(_event), sys(_sys)
+   {
+   }
+} runningData;
+
+typedef std::vector<runningData*> runningVector;
+
+// options of the wait engine
+typedef struct waitOptions {
+   bool           quiet;
+   bool           holdLocks;     // the locks of lock events are kept till exit
+   bool           usePort;       // the completion port backend is used for any number of events
+} waitOptions;
+
+// profiling phases
+enum profilePhase {
+   PHASE_ARGUMENTS   = 0,
+   PHASE_PROCESSES,
+   PHASE_FIND,
+   PHASE_HANDLES,
+   PHASE_WAIT,
+   PHASE_ENGINE,
+   PHASE_EXIT,
+   PHASE_COMMAND,
+   PHASE_COUNT
+};
+
+const char* profilePhases[PHASE_COUNT] = {
+   "arguments",
+   "get processes",
+   "find process",
+   "handles",
+   "wait",
+   "events",
+   "exit",
+   "command"
+};
+
+// profiling data structure
+typedef struct profileData {
+   bool           enabled;
+   profilePhase   phase;         // the phase currently measured
+   LONGLONG       start;         // the phase start counter
+   LONGLONG       time[PHASE_COUNT];
+   ULONGLONG      processes;     // processes scanned
+   ULONGLONG      comparisons;   // process id and name comparisons
+   ULONGLONG      objects;       // kernel objects created
+   ULONGLONG      wakeups;
+} profileData;
+
+profileData profile = { false, PHASE_ARGUMENTS };
+
 void print_title()
 {
    puts(
@@ -83,7 +386,11 @@ void print_help()
    print_title();
    puts(
 "Usage: wait [-d <delta>] [-t <time>] [-p <process id> | <process name>]\r\n"
-"            [-a] [-q]\r\n"
+"            [-s <signal> | <event name>] [-n [<condition>:]<command> | @<name>]\r\n"
+"            [-l <lock file>] [--hold] [-m <path>] [-u <path>] [-v <device>]\r\n"
+"            [-r <process name>:<count>]\r\n"
+"            [-e <expression>] [-a] [-q] [--profile] [--port]\r\n"
+"            [-- <command> [<arguments>]]\r\n"
 "\r\n"
 "Options:\r\n"
 " -h; -?; --help  : show this message.\r\n"
@@ -91,9 +398,52 @@ void print_help()
 " -t; --time      : time event. Wait till specific time.\r\n"
 " -p; --process   : process event. Wait till end of specific process.\r\n"
 "                   The process can be specified by its id or image name.\r\n"
-" -a; --all       : wait all events. Without this option the program will exit\r\n" 
-"                   when just one of events occurs.\r\n"
+" -s; --signal    : signal event. Wait till the console control signal or\r\n"
+"                   till the named event is set by other process. The signal\r\n"
+"                   is one of int (sigint), break (sigbreak), close (hup,\r\n"
+"                   sighup), logoff, shutdown (term, sigterm); any other name\r\n"
+"                   is a name of kernel event. The signal given as event does\r\n"
+"                   not interrupt the wait, but close, logoff and shutdown\r\n"
+"                   can only end it: the system terminates the program after\r\n"
+"                   them, so when such signal does not satisfy the expression\r\n"
+"                   the program returns its special code.\r\n"
+" -n; --notify    : notify event. Launch the command with NOTIFY_SOCKET set to\r\n"
+"                   the mailslot owned by wait and wait till the command\r\n"
+"                   sends READY=1 message (sd_notify protocol). The condition\r\n"
+"                   is one of ready (default), status (STATUS=) or errno\r\n"
+"                   (ERRNO=). With @<name> no command is launched and\r\n"
+"                   messages are received from \\\\.\\mailslot\\<name>.\r\n"
+" -l; --lock      : lock event. Wait till the lock of the file is released.\r\n"
+"     --hold      : acquire the locks of lock events and keep them till exit.\r\n"
+"                   Only the locks which make the expression true are kept\r\n"
+"                   for the command, other lock requests are cancelled.\r\n"
+" -m; --mount     : mount event. Wait till the path becomes a mount point (drive\r\n"
+"                   root or volume mount folder).\r\n"
+" -u; --unmount   : unmount event. Wait till the path is no longer a mount point.\r\n"
+"                   The mount point is rechecked every second when its parent\r\n"
+"                   directory does not exist or more than 62 parent directories\r\n"
+"                   are watched.\r\n"
+" -v; --device    : device event. Wait till the device name (e.g. COM3,\r\n"
+"                   PhysicalDrive1, E:) appears. Mount, unmount and device\r\n"
+"                   events receive device notifications through a window, so\r\n"
+"                   logoff and shutdown signals are not seen with them.\r\n"
+" -r; --max-running : running processes event. Wait till number of running\r\n"
+"                   processes with the image name drops below the count.\r\n"
+"                   The image file name must match as a whole, .exe may be\r\n"
+"                   omitted. The processes started during the wait are counted\r\n"
+"                   when the count drops below the limit.\r\n"
+" --              : run the command when the wait is over, the program returns\r\n"
+"                   exit code of the command.\r\n"
+" -e; --expr      : events expression. Wait till the expression is satisfied.\r\n"
+" -a; --all       : wait all events and expressions. Without this option\r\n" 
+"                   the program will exit when just one of them occurs.\r\n"
 " -q; --quiet     : suppress any output, quiet mode.\r\n"
+"     --profile   : print timings of the program phases and counters to the\r\n"
+"                   standard error output, even in quiet mode.\r\n"
+"     --port      : wait through the completion port. It has no limit on number\r\n"
+"                   of events and is used automatically for more than 32 events.\r\n"
+"                   Time events share one timer there, which is set to the\r\n"
+"                   nearest deadline.\r\n"
 "\r\n"
 "Formats:\r\n"
 "1. Time delta format:\r\n"
@@ -121,15 +471,34 @@ void print_help()
 " SS   - second\r\n"
 " f    - millisecond\r\n"
 "\r\n"
+"3. Expression format:\r\n"
+"\r\n"
+"<event> | !<expr> | (<expr>) | <expr> & <expr> | <expr> | <expr>\r\n"
+"\r\n"
+"where:\r\n"
+" event - <type>:<value> or <type>:\"<value>\", the type is d (delta),\r\n"
+"         t (time), p (process), s (signal), n (notify), l (lock),\r\n"
+"         m (mount), u (unmount), v (device) or r (running)\r\n"
+" !     - negation, true till the operand occurs or when it can no longer\r\n"
+"         occur; the expression true only by negations is satisfied at once\r\n"
+" &     - all operands must be satisfied\r\n"
+" |     - any of operands must be satisfied\r\n"
+"\r\n"
+"example: (p:db & p:cache) | d:10m\r\n"
+"         d:10m & !p:setup (10 minutes passed and setup is still running)\r\n"
+"\r\n"
 "Return codes:\r\n"
-"The program returns index of first occured event or one of special codes:\r\n"
+"The program returns index of first occured event (or index of satisfied\r\n"
+"operand of top level | in the expression) or one of special codes:\r\n"
 "-1 - Ctrl+C or Ctrl+Break interruption\r\n"
 "-2 - program was closed\r\n"
 "-3 - user logoff event\r\n"
 "-4 - system shutdown event\r\n"
 "-5 - show help message\r\n"
 "-6 - error occurs\r\n"
-"negative number of events if you pass more than 32 events"
+"-7 - the expression can no longer be satisfied\r\n"
+"negative number of events if you pass more than 32 events and the completion\r\n"
+"port is not available"
    );
 }
 
@@ -149,7 +518,33 @@ void print_handle_error()
    );
 }
 
-void print_event(const eventData* ed)
+void print_expression_error(const wchar_t* expr)
+{
+   print_title();
+   wprintf(L"Invalid expression: %s\r\n", expr);
+}
+
+void print_profile()
+{
+   LARGE_INTEGER frequency;
+   if (!::QueryPerformanceFrequency( &frequency ) || 0 == frequency.QuadPart)
+   {
+      return;
+   }
+   
+   fputs("Profile:\r\n", stderr);
+   for (int phase = 0; phase < PHASE_COUNT; phase++)
+   {
+      fprintf(stderr, " %-16s: %.3f ms\r\n", profilePhases[phase], 
+         1000.0 * static_cast<double>(profile.time[phase]) / static_cast<double>(frequency.QuadPart));
+   }
+   fprintf(stderr, " %-16s: %llu\r\n", "processes", profile.processes);
+   fprintf(stderr, " %-16s: %llu\r\n", "comparisons", profile.comparisons);
+   fprintf(stderr, " %-16s: %llu\r\n", "kernel objects", profile.objects);
+   fprintf(stderr, " %-16s: %llu\r\n", "wakeups", profile.wakeups);
+}
+
+void print_event(const eventData* ed, nodeState state)
 {
    std::wstring msg;
 
@@ -157,10 +552,21 @@ void print_event(const eventData* ed)
    case EVENT_TIMEDELTA:   msg = L"Event: time delta "; break;
    case EVENT_TIME:        msg = L"Event: time "; break;
    case EVENT_PROCESS:     msg = L"Event: process "; break;
+   case EVENT_SIGNAL:      msg = L"Event: signal "; break;
+   case EVENT_NOTIFY:      msg = L"Event: notify "; break;
+   case EVENT_LOCK:        msg = L"Event: lock "; break;
+   case EVENT_MOUNT:       msg = L"Event: mount "; break;
+   case EVENT_UNMOUNT:     msg = L"Event: unmount "; break;
+   case EVENT_DEVICE:      msg = L"Event: device "; break;
+   case EVENT_RUNNING:     msg = L"Event: running "; break;
    }
    if (!msg.empty())
    {
       msg += ed->text;
+      if (STATE_FALSE == state)
+      {
+         msg += L" (can no longer occur)";
+      }
       _putws( msg.c_str() );
    }
 }
@@ -179,6 +585,10 @@ void print_special(int rc)
    {
       puts("The system is shutting down.");
    }
+   else if (RETURNCODE_UNSATISFIED == rc)
+   {
+      puts("The expression can no longer be satisfied.");
+   }
    else
    {
       puts("The wait was interrupted.");
@@ -422,205 +832,2209 @@ bool parse_process(const wchar_t* str, ULONGLONG* value)
    return false;
 }
 
-void get_processes(processVector& processes)
+bool parse_signal(const wchar_t* str, ULONGLONG* value)
 {
-   HANDLE hProcesses, hModules;
-   PROCESSENTRY32 pe;
-   MODULEENTRY32 me;
-   
-   hProcesses = ::CreateToolhelp32Snapshot( TH32CS_SNAPPROCESS, 0 );
-   if (INVALID_HANDLE_VALUE != hProcesses)
+   if (str && value && *str)
    {
-      pe.dwSize = sizeof(PROCESSENTRY32);
-      me.dwSize = sizeof(MODULEENTRY32);
-      if (Process32First( hProcesses, &pe ))
+      *value = SIGNAL_NAMED;
+      for (size_t index = 0; index < sizeof(signalNames) / sizeof(signalNames[0]); index++)
       {
-         do
+         if (0 == _wcsicmp(str, signalNames[index].name))
          {
-            processInfo pi( pe.th32ProcessID );
-         
-            if (0 != pe.th32ProcessID)
-            {
-               hModules = ::CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, pe.th32ProcessID);
-               if (INVALID_HANDLE_VALUE != hModules)
-               {
-                  if (Module32First(hModules, &me))
-                  {
-                     pi.imageName.assign( me.szExePath );
-                  }
-                  ::CloseHandle( hModules );
-               }
-            }
-            
-            if (pi.imageName.empty())
-            {
-               pi.imageName.assign( pe.szExeFile );
-            }
-            
-            processes.push_back( pi );
+            *value = static_cast<ULONGLONG>(signalNames[index].ctrlType);
+            break;
          }
-         while (Process32Next( hProcesses, &pe ));
       }
-      ::CloseHandle( hProcesses );
+      return true;
    }
+   return false;
 }
 
-bool is_in_string(const wchar_t* whole, size_t wholelen, const wchar_t* part, size_t partlen)
+// <process name>:<limit>
+bool parse_running(const wchar_t* str, ULONGLONG* value)
 {
-   if (whole == part)
-   {
-      return (partlen <= wholelen);
-   }
-   if (whole && part && partlen > 0 && partlen <= wholelen)
+   if (str && value)
    {
-      while (wholelen >= partlen)
+      const wchar_t* colon = wcsrchr(str, L':');
+      if (colon && colon > str)
       {
-         if (CSTR_EQUAL == ::CompareStringW(
-            LOCALE_INVARIANT, 
-            NORM_IGNORECASE | SORT_STRINGSORT, 
-            whole, static_cast<DWORD>(partlen), 
-            part, static_cast<DWORD>(partlen))
-         )
+         wchar_t* ptr = NULL;
+         unsigned long limit = wcstoul(colon + 1, &ptr, 10);
+         if (ERANGE != errno && ptr != colon + 1 && !(*ptr) && limit > 0 && limit <= LONG_MAX)
          {
+            *value = static_cast<ULONGLONG>(limit);
             return true;
          }
-         whole++;
-         wholelen--;
       }
    }
    return false;
 }
 
-processInfo* find_process_info(const wchar_t* name, DWORD id, processVector& processes)
+const wchar_t* notify_target(const wchar_t* str, ULONGLONG* condition)
 {
-   if (LONG_MAX != id)
+   for (size_t index = 0; index < sizeof(notifyConditions) / sizeof(notifyConditions[0]); index++)
    {
-      for (processVector::iterator it = processes.begin(); it != processes.end(); it++)
+      size_t len = wcslen(notifyConditions[index].name);
+      if (0 == _wcsnicmp(str, notifyConditions[index].name, len) && L':' == str[len])
       {
-         if (id == it->id)
-         {
-            return &(*it);
-         }
+         if (condition) *condition = notifyConditions[index].condition;
+         return str + len + 1;
       }
    }
-   
-   if (name)
+   if (condition) *condition = NOTIFY_READY;
+   return str;
+}
+
+bool parse_notify(const wchar_t* str, ULONGLONG* value)
+{
+   if (str && value)
    {
-      const wchar_t* end = name + wcslen(name);
-      while (name < end && iswspace(*name)) name++;
-      while (name < end && iswspace(*(end - 1))) end--;   
-      if (name < end)
+      const wchar_t* target = notify_target(str, value);
+      if (L'@' == *target)
       {
-         std::wstring part( name, end - name );
-         for (processVector::iterator it = processes.begin(); it != processes.end(); it++)
-         {
-            if (is_in_string(it->imageName.c_str(), it->imageName.size(), part.c_str(), part.size()))
-            {
-               return &(*it);
-            }
-         }
+         *value |= NOTIFY_EXTERNAL;
+         target++;
       }
+      return (0 != *target);
    }
-      
-   return NULL;
+   return false;
 }
 
-HANDLE ctrlEvent = NULL;
-int ctrlCode = RETURNCODE_SIGINT;
+bool match_notify(const char* msg, size_t size, ULONGLONG condition)
+{
+   // the message is a newline separated list of assignments
+   const char* end = msg + size;
+   while (msg < end)
+   {
+      const char* eol = msg;
+      while (eol < end && '\n' != *eol) eol++;
+      
+      size_t len = eol - msg;
+      if ((NOTIFY_READY & condition) && 7 == len && 0 == memcmp(msg, "READY=1", 7))
+      {
+         return true;
+      }
+      if ((NOTIFY_STATUS & condition) && len >= 7 && 0 == memcmp(msg, "STATUS=", 7))
+      {
+         return true;
+      }
+      if ((NOTIFY_ERRNO & condition) && len >= 6 && 0 == memcmp(msg, "ERRNO=", 6))
+      {
+         return true;
+      }
+      msg = eol + 1;
+   }
+   return false;
+}
 
-BOOL WINAPI ctrl_handler(DWORD dwCtrlType)
+HANDLE start_process(const wchar_t* command, DWORD* id)
 {
-   switch (dwCtrlType) {
-   case CTRL_CLOSE_EVENT:
-      ctrlCode = RETURNCODE_CLOSE;
-      break;
-   case CTRL_LOGOFF_EVENT:
-      ctrlCode = RETURNCODE_LOGOFF;
-      break;
-   case CTRL_SHUTDOWN_EVENT:
-      ctrlCode = RETURNCODE_SHUTDOWN;
-      break;
-   default:
-      ctrlCode = RETURNCODE_SIGINT;
+   STARTUPINFOW si;
+   PROCESS_INFORMATION pi;
+   std::vector<wchar_t> cmdline( command, command + wcslen(command) + 1 );
+   
+   memset(&si, 0, sizeof(STARTUPINFOW));
+   si.cb = sizeof(STARTUPINFOW);
+   
+   if (!::CreateProcessW(NULL, &cmdline[0], NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi))
+   {
+      return NULL;
    }
+   ::CloseHandle( pi.hThread );
+   if (id) *id = pi.dwProcessId;
+   return pi.hProcess;
+}
+
+int run_command(const std::wstring& command)
+{
+   DWORD code;
+   HANDLE process = start_process(command.c_str(), NULL);
    
-   if (NULL != ctrlEvent)
+   if (NULL == process)
    {
-      ::SetEvent( ctrlEvent );
-      return TRUE;
+      return RETURNCODE_ERROR;
+   }
+   ::WaitForSingleObject(process, INFINITE);
+   if (!::GetExitCodeProcess(process, &code))
+   {
+      code = static_cast<DWORD>(RETURNCODE_ERROR);
    }
-   return FALSE;
+   ::CloseHandle( process );
+   return static_cast<int>(code);
 }
 
-int wmain(int argc, wchar_t *argv[])
+void append_argument(std::wstring& cmdline, const wchar_t* arg)
 {
-   ULONGLONG   current_ftime;
-   SYSTEMTIME  current_stime;
-   bool        quiet       = false;
-   bool        wait_all    = false;
-   int         arg_state   = ARGSTATE_NONE;
-   eventVector events;
+   if (!cmdline.empty())
+   {
+      cmdline += L' ';
+   }
+   if (*arg && !wcspbrk(arg, L" \t\""))
+   {
+      cmdline += arg;
+      return;
+   }
    
-   ::GetLocalTime( &current_stime );
+   // quoting compatible with CommandLineToArgvW
+   cmdline += L'"';
+   for (;; arg++)
    {
-      FILETIME ft, ftu;
-      if (!::SystemTimeToFileTime(&current_stime, &ft))
+      size_t slashes = 0;
+      while (L'\\' == *arg)
       {
-         return RETURNCODE_ERROR;
+         slashes++;
+         arg++;
       }
-      if (!::LocalFileTimeToFileTime( &ft, &ftu ))
+      if (!(*arg))
       {
-         return RETURNCODE_ERROR;
+         cmdline.append(slashes * 2, L'\\');
+         break;
+      }
+      if (L'"' == *arg)
+      {
+         cmdline.append(slashes * 2 + 1, L'\\');
+      }
+      else
+      {
+         cmdline.append(slashes, L'\\');
       }
-      memcpy(&current_ftime, &ftu, sizeof(ULONGLONG));
+      cmdline += *arg;
+   }
+   cmdline += L'"';
+}
+
+bool read_notify(eventData& ed)
+{
+   memset(&ed.overlapped, 0, sizeof(OVERLAPPED));
+   ed.overlapped.hEvent = ed.handle;
+   if (!::ReadFile(ed.object, &ed.buffer[0], static_cast<DWORD>(ed.buffer.size()), NULL, &ed.overlapped))
+   {
+      return (ERROR_IO_PENDING == ::GetLastError());
    }
+   return true;
+}
+
+bool open_notify(eventData& ed, size_t index, bool quiet)
+{
+   const wchar_t* target = notify_target(ed.text.c_str(), NULL);
+   std::wstring path( L"\\\\.\\mailslot\\" );
    
-   for (int argi = 0; argi < argc; argi++)
+   if (NOTIFY_EXTERNAL & ed.data)
    {
-      const wchar_t* arg = argv[ argi ];
-      if (!arg) continue;      
+      path += target + 1;
+   }
+   else
+   {
+      wchar_t name[64];
+      _snwprintf(name, sizeof(name) / sizeof(name[0]), L"wait\\%u.%u", ::GetCurrentProcessId(), static_cast<unsigned>(index));
+      name[ sizeof(name) / sizeof(name[0]) - 1 ] = 0;
+      path += name;
+   }
    
-      if (ARGSTATE_DELTA == arg_state)
-      {
-         ULONGLONG delta_value;
-         if (parse_delta(arg, &delta_value))
-         {
-            events.push_back( eventData(EVENT_TIMEDELTA, arg, delta_value) );
-         }
-         arg_state = ARGSTATE_NONE;
-      }
-      else if (ARGSTATE_TIME == arg_state)
+   ed.object = ::CreateMailslotW(path.c_str(), NOTIFY_BUFFER_SIZE, MAILSLOT_WAIT_FOREVER, NULL);
+   if (INVALID_HANDLE_VALUE == ed.object)
+   {
+      ed.object = NULL;
+      return false;
+   }
+   ed.handle = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+   if (NULL == ed.handle)
+   {
+      return false;
+   }
+   ed.buffer.resize( NOTIFY_BUFFER_SIZE );
+   if (!read_notify(ed))
+   {
+      return false;
+   }
+   
+   if (!(NOTIFY_EXTERNAL & ed.data))
+   {
+      DWORD id;
+      
+      // the command inherits the environment with NOTIFY_SOCKET
+      ::SetEnvironmentVariableW(L"NOTIFY_SOCKET", path.c_str());
+      HANDLE process = start_process(target, &id);
+      ::SetEnvironmentVariableW(L"NOTIFY_SOCKET", NULL);
+      if (NULL == process)
       {
-         ULONGLONG time_value;
-         if (parse_time(arg, &time_value, &current_stime))
-         {
-            events.push_back( eventData(EVENT_TIME, arg, time_value) );
-         }
-         arg_state = ARGSTATE_NONE;
+         return false;
       }
-      else if (ARGSTATE_PROCESS == arg_state)
+      if (!quiet)
       {
-         ULONGLONG process_value;
-         if (parse_process(arg, &process_value))
-         {
-            events.push_back( eventData(EVENT_PROCESS, arg, process_value) );
-         }
-         arg_state = ARGSTATE_NONE;
+         wprintf(L"Process %s started (%u), NOTIFY_SOCKET=%s\r\n", target, id, path.c_str());
       }
-      else
-      {
-         bool long_options = false;
-         if (L'-' == *arg)
-         {
-            arg++;
-            if (L'-' == *arg)
-            {
-               long_options = true;
-               arg++;
-            }
-         }
-         else if (L'/' == *arg)
-         {
+      
+      // the command has exited before the condition was met
+      ed.failure = process;
+   }
+   return true;
+}
+
+void unlock_lock(eventData& ed)
+{
+   OVERLAPPED overlapped;
+   memset(&overlapped, 0, sizeof(OVERLAPPED));
+   ::UnlockFileEx(ed.object, 0, MAXDWORD, MAXDWORD, &overlapped);
+}
+
+bool open_lock(eventData& ed, bool hold)
+{
+   ed.object = ::CreateFileW(
+      ed.text.c_str(), 
+      GENERIC_READ, 
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 
+      NULL, 
+      OPEN_ALWAYS, 
+      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, 
+      NULL
+   );
+   if (INVALID_HANDLE_VALUE == ed.object)
+   {
+      ed.object = NULL;
+      return false;
+   }
+   ed.handle = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+   if (NULL == ed.handle)
+   {
+      return false;
+   }
+   if (hold)
+   {
+      ed.data |= LOCK_HOLD;
+   }
+   
+   // the kernel signals the event when the lock is acquired
+   memset(&ed.overlapped, 0, sizeof(OVERLAPPED));
+   ed.overlapped.hEvent = ed.handle;
+   if (!::LockFileEx(ed.object, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &ed.overlapped))
+   {
+      return (ERROR_IO_PENDING == ::GetLastError());
+   }
+   return true;
+}
+
+LONGLONG profile_counter()
+{
+   LARGE_INTEGER counter;
+   return ::QueryPerformanceCounter( &counter ) ? counter.QuadPart : 0;
+}
+
+// finishes the current phase and starts the next one
+void profile_enter(profilePhase phase)
+{
+   LONGLONG counter = profile_counter();
+   profile.time[profile.phase] += counter - profile.start;
+   profile.phase = phase;
+   profile.start = counter;
+   WAIT_PROBE("Phase", phase);
+}
+
+deviceWatcher watcher = { watchVector(), 0, NULL, NULL, NULL };
+windowFunctions user32 = { NULL };
+
+template <typename T> bool load_function(T& function, const char* name)
+{
+   function = reinterpret_cast<T>( ::GetProcAddress(user32.module, name) );
+   return (NULL != function);
+}
+
+bool load_user32()
+{
+   user32.module = ::LoadLibraryW( L"user32.dll" );
+   if (NULL == user32.module)
+   {
+      return false;
+   }
+   return load_function(user32.registerClass, "RegisterClassW") &&
+      load_function(user32.createWindow, "CreateWindowExW") &&
+      load_function(user32.destroyWindow, "DestroyWindow") &&
+      load_function(user32.defWindowProc, "DefWindowProcW") &&
+      load_function(user32.registerNotification, "RegisterDeviceNotificationW") &&
+      load_function(user32.unregisterNotification, "UnregisterDeviceNotification") &&
+      load_function(user32.msgWait, "MsgWaitForMultipleObjects") &&
+      load_function(user32.peekMessage, "PeekMessageW") &&
+      load_function(user32.dispatchMessage, "DispatchMessageW");
+}
+
+bool is_mount_point(const std::wstring& path)
+{
+   wchar_t volume[MAX_PATH + 1];
+   DWORD attributes = ::GetFileAttributesW( path.c_str() );
+   
+   if (INVALID_FILE_ATTRIBUTES == attributes || !(FILE_ATTRIBUTE_DIRECTORY & attributes))
+   {
+      return false;
+   }
+   if (!::GetVolumePathNameW(path.c_str(), volume, MAX_PATH + 1))
+   {
+      return false;
+   }
+   return (0 == _wcsicmp(volume, path.c_str()));
+}
+
+bool is_device_present(const std::wstring& name)
+{
+   wchar_t target[MAX_PATH];
+   return (0 != ::QueryDosDeviceW(name.c_str(), target, MAX_PATH) || ERROR_INSUFFICIENT_BUFFER == ::GetLastError());
+}
+
+void watch_update(watchItem& item)
+{
+   bool state;
+   switch (item.type) {
+   case EVENT_MOUNT:    state = is_mount_point(item.path); break;
+   case EVENT_UNMOUNT:  state = !is_mount_point(item.path); break;
+   default:             state = is_device_present(item.path); break;
+   }
+   if (state && !item.state)
+   {
+      ::SetEvent( item.event );
+   }
+   item.state = state;
+}
+
+// drives - changed logical drives, parent - changed directory, devices - device arrival or removal
+void watch_refresh(DWORD drives, const std::wstring* parent, bool devices)
+{
+   for (watchVector::iterator it = watcher.items.begin(); it != watcher.items.end(); it++)
+   {
+      bool recheck;
+      if (EVENT_DEVICE == it->type)
+      {
+         recheck = devices;
+      }
+      else if (it->parent.empty())
+      {
+         recheck = (0 != (drives & it->drive));
+      }
+      else
+      {
+         recheck = devices || (parent && 0 == _wcsicmp(parent->c_str(), it->parent.c_str()));
+      }
+      
+      if (recheck)
+      {
+         watch_update( *it );
+      }
+   }
+}
+
+LRESULT CALLBACK watch_window_proc(HWND window, UINT message, WPARAM wParam, LPARAM lParam)
+{
+   if (WM_DEVICECHANGE == message && (DBT_DEVICEARRIVAL == wParam || DBT_DEVICEREMOVECOMPLETE == wParam))
+   {
+      DWORD drives = ::GetLogicalDrives();
+      DWORD changed = drives ^ watcher.drives;
+      
+      const DEV_BROADCAST_HDR* hdr = reinterpret_cast<const DEV_BROADCAST_HDR*>(lParam);
+      if (hdr && DBT_DEVTYP_VOLUME == hdr->dbch_devicetype)
+      {
+         // media arrival does not change the drives mask
+         changed |= reinterpret_cast<const DEV_BROADCAST_VOLUME*>(lParam)->dbcv_unitmask;
+      }
+      watcher.drives = drives;
+      watch_refresh(changed, NULL, true);
+   }
+   return user32.defWindowProc(window, message, wParam, lParam);
+}
+
+// the thread exits with the error code when it cannot receive device notifications
+DWORD WINAPI watch_thread(LPVOID)
+{
+   HANDLE handles[MAXIMUM_WAIT_OBJECTS - 1];
+   std::vector<std::wstring> dirs;
+   indexVector polled;
+   DWORD count = 1;
+   
+   // the volume broadcasts are sent to top level windows only
+   WNDCLASSW wc;
+   memset(&wc, 0, sizeof(WNDCLASSW));
+   wc.lpfnWndProc = watch_window_proc;
+   wc.hInstance = ::GetModuleHandleW(NULL);
+   wc.lpszClassName = L"WaitDeviceWatcher";
+   user32.registerClass( &wc );
+   
+   HWND window = user32.createWindow(0, wc.lpszClassName, L"", 0, 0, 0, 0, 0, NULL, NULL, wc.hInstance, NULL);
+   HDEVNOTIFY notify = NULL;
+   if (NULL != window)
+   {
+      DEV_BROADCAST_DEVICEINTERFACE_W filter;
+      memset(&filter, 0, sizeof(filter));
+      filter.dbcc_size = sizeof(filter);
+      filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+      notify = user32.registerNotification(window, &filter, DEVICE_NOTIFY_WINDOW_HANDLE | DEVICE_NOTIFY_ALL_INTERFACE_CLASSES);
+   }
+   if (NULL == notify)
+   {
+      DWORD error = ::GetLastError();
+      if (NULL != window)
+      {
+         user32.destroyWindow( window );
+      }
+      return error;
+   }
+   
+   // mount point folders are watched through their parent directories, the missing 
+   // directory or the directory over the wait limit is rechecked periodically
+   handles[0] = watcher.stop;
+   for (size_t index = 0; index < watcher.items.size(); index++)
+   {
+      const std::wstring& parent = watcher.items[index].parent;
+      if (parent.empty() || dirs.end() != std::find(dirs.begin(), dirs.end(), parent))
+      {
+         continue;
+      }
+      HANDLE change = INVALID_HANDLE_VALUE;
+      if (count < MAXIMUM_WAIT_OBJECTS - 1)
+      {
+         change = ::FindFirstChangeNotificationW(parent.c_str(), FALSE, FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_ATTRIBUTES);
+      }
+      if (INVALID_HANDLE_VALUE != change)
+      {
+         handles[count++] = change;
+         dirs.push_back( parent );
+      }
+      else
+      {
+         polled.push_back( index );
+      }
+   }
+   
+   // the state is checked after notifications are set to not miss a change
+   watcher.drives = ::GetLogicalDrives();
+   watch_refresh(~static_cast<DWORD>(0), NULL, true);
+   ::SetEvent( watcher.ready );
+   
+   DWORD recheck = ::GetTickCount();
+   for (;;)
+   {
+      DWORD timeout = INFINITE;
+      if (!polled.empty())
+      {
+         DWORD elapsed = ::GetTickCount() - recheck;
+         if (elapsed >= WATCH_RECHECK_INTERVAL)
+         {
+            for (indexVector::iterator it = polled.begin(); it != polled.end(); it++)
+            {
+               watch_update( watcher.items[*it] );
+            }
+            recheck += elapsed;
+            elapsed = 0;
+         }
+         timeout = WATCH_RECHECK_INTERVAL - elapsed;
+      }
+      
+      DWORD code = user32.msgWait(count, handles, FALSE, timeout, QS_ALLINPUT);
+      if (WAIT_OBJECT_0 == code || WAIT_FAILED == code)
+      {
+         break;
+      }
+      if (WAIT_TIMEOUT == code)
+      {
+         continue;
+      }
+      if (code < WAIT_OBJECT_0 + count)
+      {
+         ::FindNextChangeNotification( handles[code - WAIT_OBJECT_0] );
+         watch_refresh(0, &dirs[code - WAIT_OBJECT_0 - 1], false);
+      }
+      else
+      {
+         MSG msg;
+         while (user32.peekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+         {
+            user32.dispatchMessage( &msg );
+         }
+      }
+   }
+   
+   for (DWORD index = 1; index < count; index++)
+   {
+      ::FindCloseChangeNotification( handles[index] );
+   }
+   user32.unregisterNotification( notify );
+   user32.destroyWindow( window );
+   return 0;
+}
+
+bool open_watch(eventData& ed)
+{
+   ed.handle = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+   if (NULL == ed.handle)
+   {
+      return false;
+   }
+   
+   watchItem item( ed.type, ed.handle );
+   if (EVENT_DEVICE == ed.type)
+   {
+      // \\.\<name> is accepted as well
+      const wchar_t* name = ed.text.c_str();
+      if (0 == wcsncmp(name, L"\\\\.\\", 4))
+      {
+         name += 4;
+      }
+      item.path = name;
+   }
+   else
+   {
+      wchar_t full[MAX_PATH + 1];
+      wchar_t* file;
+      DWORD len = ::GetFullPathNameW(ed.text.c_str(), MAX_PATH + 1, full, &file);
+      if (0 == len || len > MAX_PATH)
+      {
+         return false;
+      }
+      item.path = full;
+      if (L'\\' != item.path[ item.path.size() - 1 ])
+      {
+         item.path += L'\\';
+      }
+      
+      size_t pos = item.path.rfind(L'\\', item.path.size() - 2);
+      if (std::wstring::npos != pos)
+      {
+         item.parent = item.path.substr(0, pos + 1);
+      }
+      if (L':' == item.path[1] && iswalpha(item.path[0]))
+      {
+         item.drive = 1 << (towupper(item.path[0]) - L'A');
+      }
+   }
+   watcher.items.push_back( item );
+   return true;
+}
+
+bool start_watcher()
+{
+   if (!watcher.items.empty())
+   {
+      if (!load_user32())
+      {
+         return false;
+      }
+      watcher.stop = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+      if (NULL == watcher.stop)
+      {
+         return false;
+      }
+      watcher.ready = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+      if (NULL == watcher.ready)
+      {
+         return false;
+      }
+      watcher.thread = ::CreateThread(NULL, 0, watch_thread, NULL, 0, NULL);
+      if (NULL == watcher.thread)
+      {
+         return false;
+      }
+      
+      // the thread exits when the notifications cannot be set
+      HANDLE handles[2] = { watcher.ready, watcher.thread };
+      if (WAIT_OBJECT_0 != ::WaitForMultipleObjects(2, handles, FALSE, INFINITE))
+      {
+         DWORD error = ERROR_GEN_FAILURE;
+         ::GetExitCodeThread( watcher.thread, &error );
+         ::SetLastError( error );
+         return false;
+      }
+   }
+   return true;
+}
+
+void stop_watcher()
+{
+   if (NULL != watcher.thread)
+   {
+      ::SetEvent( watcher.stop );
+      ::WaitForSingleObject( watcher.thread, INFINITE );
+      ::CloseHandle( watcher.thread );
+      watcher.thread = NULL;
+   }
+   if (NULL != watcher.stop)
+   {
+      ::CloseHandle( watcher.stop );
+      watcher.stop = NULL;
+   }
+   if (NULL != watcher.ready)
+   {
+      ::CloseHandle( watcher.ready );
+      watcher.ready = NULL;
+   }
+   if (NULL != user32.module)
+   {
+      ::FreeLibrary( user32.module );
+      user32.module = NULL;
+   }
+   watcher.items.clear();
+}
+
+void get_processes(processVector& processes)
+{
+   HANDLE hProcesses, hModules;
+   PROCESSENTRY32 pe;
+   MODULEENTRY32 me;
+   DWORD self = ::GetCurrentProcessId();
+   
+   hProcesses = ::CreateToolhelp32Snapshot( TH32CS_SNAPPROCESS, 0 );
+   if (INVALID_HANDLE_VALUE != hProcesses)
+   {
+      pe.dwSize = sizeof(PROCESSENTRY32);
+      me.dwSize = sizeof(MODULEENTRY32);
+      if (Process32First( hProcesses, &pe ))
+      {
+         do
+         {
+            // the program never waits for itself
+            if (self == pe.th32ProcessID)
+            {
+               continue;
+            }
+            
+            processInfo pi( pe.th32ProcessID );
+         
+            if (0 != pe.th32ProcessID)
+            {
+               hModules = ::CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, pe.th32ProcessID);
+               if (INVALID_HANDLE_VALUE != hModules)
+               {
+                  if (Module32First(hModules, &me))
+                  {
+                     pi.imageName.assign( me.szExePath );
+                  }
+                  ::CloseHandle( hModules );
+               }
+            }
+            
+            if (pi.imageName.empty())
+            {
+               pi.imageName.assign( pe.szExeFile );
+            }
+            
+            processes.push_back( pi );
+         }
+         while (Process32Next( hProcesses, &pe ));
+      }
+      ::CloseHandle( hProcesses );
+   }
+   profile.processes += processes.size();
+   WAIT_PROBE("Processes", processes.size());
+}
+
+bool is_in_string(const wchar_t* whole, size_t wholelen, const wchar_t* part, size_t partlen)
+{
+   if (whole == part)
+   {
+      return (partlen <= wholelen);
+   }
+   if (whole && part && partlen > 0 && partlen <= wholelen)
+   {
+      while (wholelen >= partlen)
+      {
+         profile.comparisons++;
+         if (CSTR_EQUAL == ::CompareStringW(
+            LOCALE_INVARIANT, 
+            NORM_IGNORECASE | SORT_STRINGSORT, 
+            whole, static_cast<DWORD>(partlen), 
+            part, static_cast<DWORD>(partlen))
+         )
+         {
+            return true;
+         }
+         whole++;
+         wholelen--;
+      }
+   }
+   return false;
+}
+
+processInfo* find_process_info(const wchar_t* name, DWORD id, processVector& processes)
+{
+   if (LONG_MAX != id)
+   {
+      for (processVector::iterator it = processes.begin(); it != processes.end(); it++)
+      {
+         profile.comparisons++;
+         if (id == it->id)
+         {
+            return &(*it);
+         }
+      }
+   }
+   
+   if (name)
+   {
+      const wchar_t* end = name + wcslen(name);
+      while (name < end && iswspace(*name)) name++;
+      while (name < end && iswspace(*(end - 1))) end--;   
+      if (name < end)
+      {
+         std::wstring part( name, end - name );
+         for (processVector::iterator it = processes.begin(); it != processes.end(); it++)
+         {
+            if (is_in_string(it->imageName.c_str(), it->imageName.size(), part.c_str(), part.size()))
+            {
+               return &(*it);
+            }
+         }
+      }
+   }
+      
+   return NULL;
+}
+
+bool add_event(eventType type, const wchar_t* text, const SYSTEMTIME* current, eventVector& events)
+{
+   ULONGLONG value;
+   bool rc = false;
+   
+   switch (type) {
+   case EVENT_TIMEDELTA:   rc = parse_delta(text, &value); break;
+   case EVENT_TIME:        rc = parse_time(text, &value, current); break;
+   case EVENT_PROCESS:     rc = parse_process(text, &value); break;
+   case EVENT_SIGNAL:      rc = parse_signal(text, &value); break;
+   case EVENT_NOTIFY:      rc = parse_notify(text, &value); break;
+   case EVENT_RUNNING:     rc = parse_running(text, &value); break;
+   case EVENT_LOCK:
+   case EVENT_MOUNT:
+   case EVENT_UNMOUNT:
+   case EVENT_DEVICE:      rc = (text && *text); value = 0; break;
+   }
+   if (rc)
+   {
+      events.push_back( eventData(type, text, value) );
+   }
+   return rc;
+}
+
+void link_node(nodeVector& nodes, size_t parent, size_t child)
+{
+   nodes[parent].children.push_back( child );
+   nodes[child].parents.push_back( parent );
+   nodes[child].liveParents++;
+}
+
+bool is_same_event(const eventData& ed1, const eventData& ed2)
+{
+   if (ed1.type != ed2.type)
+   {
+      return false;
+   }
+   if (EVENT_SIGNAL == ed1.type && SIGNAL_NAMED != ed1.data)
+   {
+      // the console control signal has several names
+      return (ed1.data == ed2.data);
+   }
+   return (0 == _wcsicmp(ed1.text.c_str(), ed2.text.c_str()));
+}
+
+size_t add_event_node(eventType type, const wchar_t* text, const SYSTEMTIME* current, eventVector& events, nodeVector& nodes)
+{
+   if (!add_event(type, text, current, events))
+   {
+      return NO_NODE;
+   }
+   
+   // the same event is shared between all its parents
+   for (size_t index = 0; index < nodes.size(); index++)
+   {
+      if (NODE_EVENT == nodes[index].type && is_same_event(events[ nodes[index].event ], events.back()))
+      {
+         events.pop_back();
+         return index;
+      }
+   }
+   
+   events.back().node = nodes.size();
+   nodes.push_back( nodeData(NODE_EVENT, events.size() - 1) );
+   return events.back().node;
+}
+
+void skip_spaces(exprContext& ctx)
+{
+   while (iswspace(*ctx.ptr)) ctx.ptr++;
+}
+
+size_t parse_expr_binary(exprContext& ctx, nodeType type);
+
+size_t parse_expr_event(exprContext& ctx)
+{
+   const wchar_t* name = ctx.ptr;
+   while (iswalpha(*ctx.ptr)) ctx.ptr++;
+   
+   size_t namelen = ctx.ptr - name;
+   if (0 == namelen || L':' != *ctx.ptr)
+   {
+      return NO_NODE;
+   }
+   ctx.ptr++;
+   
+   std::wstring value;
+   if (L'"' == *ctx.ptr)
+   {
+      const wchar_t* start = ++ctx.ptr;
+      while (*ctx.ptr && L'"' != *ctx.ptr) ctx.ptr++;
+      if (!(*ctx.ptr))
+      {
+         return NO_NODE;
+      }
+      value.assign( start, ctx.ptr - start );
+      ctx.ptr++;
+   }
+   else
+   {
+      const wchar_t* start = ctx.ptr;
+      while (*ctx.ptr && !iswspace(*ctx.ptr) && !wcschr(L"&|!()", *ctx.ptr)) ctx.ptr++;
+      value.assign( start, ctx.ptr - start );
+   }
+   
+   if (!value.empty())
+   {
+      for (size_t index = 0; index < sizeof(eventPrefixes) / sizeof(eventPrefixes[0]); index++)
+      {
+         const eventPrefix& prefix = eventPrefixes[index];
+         if (0 == _wcsnicmp(name, prefix.name, namelen) && 0 == prefix.name[namelen])
+         {
+            return add_event_node(prefix.type, value.c_str(), ctx.current, *ctx.events, *ctx.nodes);
+         }
+      }
+   }
+   return NO_NODE;
+}
+
+size_t parse_expr_unary(exprContext& ctx)
+{
+   size_t node;
+   
+   skip_spaces(ctx);
+   if (L'!' == *ctx.ptr)
+   {
+      ctx.ptr++;
+      size_t child = parse_expr_unary(ctx);
+      if (NO_NODE == child)
+      {
+         return NO_NODE;
+      }
+      node = ctx.nodes->size();
+      ctx.nodes->push_back( nodeData(NODE_NOT, NO_NODE) );
+      link_node(*ctx.nodes, node, child);
+   }
+   else if (L'(' == *ctx.ptr)
+   {
+      ctx.ptr++;
+      node = parse_expr_binary(ctx, NODE_OR);
+      skip_spaces(ctx);
+      if (L')' != *ctx.ptr)
+      {
+         return NO_NODE;
+      }
+      ctx.ptr++;
+   }
+   else
+   {
+      node = parse_expr_event(ctx);
+   }
+   return node;
+}
+
+size_t parse_expr_binary(exprContext& ctx, nodeType type)
+{
+   const wchar_t op = (NODE_OR == type) ? L'|' : L'&';
+   size_t result = NO_NODE;
+   size_t node = (NODE_OR == type) ? parse_expr_binary(ctx, NODE_AND) : parse_expr_unary(ctx);
+   
+   skip_spaces(ctx);
+   while (NO_NODE != node && op == *ctx.ptr)
+   {
+      ctx.ptr++;
+      if (op == *ctx.ptr) ctx.ptr++;   // || and && are accepted too
+      
+      if (NO_NODE == result)
+      {
+         result = ctx.nodes->size();
+         ctx.nodes->push_back( nodeData(type, NO_NODE) );
+      }
+      link_node(*ctx.nodes, result, node);
+      
+      node = (NODE_OR == type) ? parse_expr_binary(ctx, NODE_AND) : parse_expr_unary(ctx);
+      skip_spaces(ctx);
+   }
+   
+   if (NO_NODE == node)
+   {
+      return NO_NODE;
+   }
+   if (NO_NODE == result)
+   {
+      return node;
+   }
+   link_node(*ctx.nodes, result, node);
+   return result;
+}
+
+size_t parse_expression(const wchar_t* str, const SYSTEMTIME* current, eventVector& events, nodeVector& nodes)
+{
+   exprContext ctx = { str, current, &events, &nodes };
+   
+   size_t node = parse_expr_binary(ctx, NODE_OR);
+   skip_spaces(ctx);
+   return (*ctx.ptr) ? NO_NODE : node;
+}
+
+// the operands are combined by the top level node
+size_t link_operands(nodeVector& nodes, const indexVector& operands, bool wait_all)
+{
+   size_t root = operands.front();
+   if (operands.size() > 1)
+   {
+      root = nodes.size();
+      nodes.push_back( nodeData(wait_all ? NODE_AND : NODE_OR, NO_NODE) );
+      for (indexVector::const_iterator it = operands.begin(); it != operands.end(); it++)
+      {
+         link_node(nodes, root, *it);
+      }
+   }
+   return root;
+}
+
+// released - receives events of deactivated leaves
+void deactivate_node(nodeVector& nodes, size_t index, indexVector& released)
+{
+   nodeData& node = nodes[index];
+   if (node.active)
+   {
+      node.active = false;
+      if (NODE_EVENT == node.type)
+      {
+         released.push_back( node.event );
+      }
+      for (indexVector::iterator it = node.children.begin(); it != node.children.end(); it++)
+      {
+         nodeData& child = nodes[*it];
+         if (child.liveParents > 0)
+         {
+            child.liveParents--;
+         }
+         if (0 == child.liveParents && STATE_PENDING == child.state)
+         {
+            // nobody is interested in the child anymore
+            deactivate_node( nodes, *it, released );
+         }
+      }
+   }
+}
+
+bool node_value(const nodeVector& nodes, const nodeData& node)
+{
+   switch (node.type) {
+   case NODE_AND: return (node.valueCount == node.children.size());
+   case NODE_OR:  return (node.valueCount > 0);
+   case NODE_NOT: return !nodes[ node.children.front() ].value;
+   default:       return node.value;
+   }
+}
+
+nodeState node_state(const nodeVector& nodes, const nodeData& node)
+{
+   switch (node.type) {
+   case NODE_AND:
+      if (node.falseCount > 0) return STATE_FALSE;
+      return (node.trueCount == node.children.size()) ? STATE_TRUE : STATE_PENDING;
+   case NODE_OR:
+      if (node.trueCount > 0) return STATE_TRUE;
+      return (node.falseCount == node.children.size()) ? STATE_FALSE : STATE_PENDING;
+   case NODE_NOT:
+      switch (nodes[ node.children.front() ].state) {
+      case STATE_TRUE:  return STATE_FALSE;
+      case STATE_FALSE: return STATE_TRUE;
+      default:          return STATE_PENDING;
+      }
+   default:
+      return node.state;
+   }
+}
+
+// computes the values before any event occurs, the nodes are not ordered so the DAG is walked
+void init_node(nodeVector& nodes, size_t index, std::vector<bool>& visited)
+{
+   if (!visited[index])
+   {
+      visited[index] = true;
+      
+      nodeData& node = nodes[index];
+      node.valueCount = 0;
+      for (indexVector::iterator it = node.children.begin(); it != node.children.end(); it++)
+      {
+         init_node( nodes, *it, visited );
+         if (nodes[*it].value) node.valueCount++;
+      }
+      node.value = node_value( nodes, node );
+   }
+}
+
+void update_node(nodeVector& nodes, size_t index, bool value, nodeState state, indexVector& released)
+{
+   nodeData& node = nodes[index];
+   bool changed = (value != node.value);
+   bool decided = (state != node.state);
+   if (!changed && !decided)
+   {
+      return;
+   }
+   
+   node.value = value;
+   node.state = state;
+   if (decided)
+   {
+      deactivate_node( nodes, index, released );
+   }
+   
+   // only active ancestors are updated
+   for (size_t i = 0; i < node.parents.size(); i++)
+   {
+      size_t pindex = node.parents[i];
+      nodeData& parent = nodes[pindex];
+      if (!parent.active || STATE_PENDING != parent.state)
+      {
+         continue;
+      }
+      
+      if (changed)
+      {
+         if (value) parent.valueCount++; else parent.valueCount--;
+      }
+      if (decided)
+      {
+         if (STATE_TRUE == state) parent.trueCount++; else parent.falseCount++;
+      }
+      update_node( nodes, pindex, node_value(nodes, parent), node_state(nodes, parent), released );
+   }
+}
+
+void decide_node(nodeVector& nodes, size_t index, nodeState state, indexVector& released)
+{
+   update_node( nodes, index, (STATE_TRUE == state), state, released );
+}
+
+// position of the first satisfied operand
+size_t node_branch(const nodeVector& nodes, size_t index)
+{
+   const indexVector& children = nodes[index].children;
+   size_t branch = 0;
+   while (branch < children.size() && !nodes[ children[branch] ].value) branch++;
+   return branch;
+}
+
+// completion port backend, every waited object is registered once in the thread pool
+// and its signal is posted to the port, one timer is set to the nearest deadline
+HANDLE waitPort = NULL;
+
+VOID CALLBACK port_callback(PVOID context, BOOLEAN timedOut)
+{
+   ::PostQueuedCompletionStatus(waitPort, 0, reinterpret_cast<ULONG_PTR>(context), NULL);
+}
+
+HANDLE ctrlEvent = NULL;
+int ctrlCode = RETURNCODE_SIGINT;
+
+// events of console control signals waited as events, indexed by control type,
+// the entry is cleared when the event can no longer change the result
+HANDLE volatile ctrlSignals[CTRL_SHUTDOWN_EVENT + 1] = { NULL };
+
+// the handler runs in its own thread, so it only sets the events
+BOOL WINAPI ctrl_handler(DWORD dwCtrlType)
+{
+   HANDLE signal = (dwCtrlType <= CTRL_SHUTDOWN_EVENT) ? ctrlSignals[dwCtrlType] : NULL;
+   
+   if (NULL != signal)
+   {
+      ::SetEvent( signal );
+   }
+   else
+   {
+      switch (dwCtrlType) {
+      case CTRL_CLOSE_EVENT:
+         ctrlCode = RETURNCODE_CLOSE;
+         break;
+      case CTRL_LOGOFF_EVENT:
+         ctrlCode = RETURNCODE_LOGOFF;
+         break;
+      case CTRL_SHUTDOWN_EVENT:
+         ctrlCode = RETURNCODE_SHUTDOWN;
+         break;
+      default:
+         ctrlCode = RETURNCODE_SIGINT;
+      }
+      
+      if (NULL == ctrlEvent)
+      {
+         return FALSE;
+      }
+      ::SetEvent( ctrlEvent );
+   }
+   
+   if (CTRL_CLOSE_EVENT == dwCtrlType || CTRL_LOGOFF_EVENT == dwCtrlType || CTRL_SHUTDOWN_EVENT == dwCtrlType)
+   {
+      // the process is terminated as soon as the handler returns, 
+      // so the main thread has time to exit with its own return code
+      ::Sleep( CTRL_EXIT_TIMEOUT );
+   }
+   return TRUE;
+}
+
+bool open_signal(eventData& ed)
+{
+   if (SIGNAL_NAMED == ed.data)
+   {
+      // auto reset event, so every SetEvent wakes one waiting instance
+      ed.handle = ::CreateEventW(NULL, FALSE, FALSE, ed.text.c_str());
+      if (NULL == ed.handle)
+      {
+         ed.handle = ::OpenEventW(SYNCHRONIZE, FALSE, ed.text.c_str());
+      }
+   }
+   else
+   {
+      ed.handle = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+      ctrlSignals[ ed.data ] = ed.handle;
+   }
+   return (NULL != ed.handle);
+}
+
+// system services used by the wait engine, replaceable by a simulator 
+// to drive the engine with virtual clock and scripted processes
+typedef struct systemInterface {
+   void      (*get_local_time)(SYSTEMTIME* time);
+   ULONGLONG (*get_time)();
+   void      (*get_processes)(processVector& processes);
+   HANDLE    (*open_process)(DWORD id);
+   HANDLE    (*create_event)(BOOL signaled);
+   void      (*set_event)(HANDLE event);
+   void      (*reset_event)(HANDLE event);
+   void      (*close_handle)(HANDLE handle);
+   HANDLE    (*create_timer)();
+   BOOL      (*set_timer)(HANDLE timer, const LARGE_INTEGER* time);
+   
+   // the callback is called once when the object is signaled
+   bool      (*watch_object)(HANDLE* wait, HANDLE object, WAITORTIMERCALLBACK callback, PVOID context);
+   void      (*unwatch_object)(HANDLE wait);
+   
+   // events other than process, time and running ones
+   bool      (*open_event)(eventData& ed, size_t index, processVector& processes, const waitOptions& options);
+   bool      (*start_events)();
+   nodeState (*check_event)(eventData& ed, HANDLE signaled);
+   void      (*release_event)(eventData& ed);
+   void      (*close_event)(eventData& ed);
+   void      (*stop_events)();
+   
+   // interruption of the wait
+   HANDLE    (*open_control)();
+   int       (*control_code)();
+   void      (*close_control)();
+   
+   // WaitForMultipleObjects backend
+   DWORD     (*wait)(DWORD count, const HANDLE* handles, DWORD timeout);
+   
+   // completion port backend
+   bool      (*open_port)();
+   bool      (*port_register)(HANDLE* wait, HANDLE handle, size_t slot);
+   DWORD     (*port_wait)(DWORD timeout);
+   void      (*port_unregister)(HANDLE wait);
+   void      (*close_port)();
+} systemInterface;
+
+void native_get_local_time(SYSTEMTIME* time)
+{
+   ::GetLocalTime( time );
+}
+
+ULONGLONG native_get_time()
+{
+   FILETIME ft;
+   ::GetSystemTimeAsFileTime( &ft );
+   return (static_cast<ULONGLONG>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+}
+
+// only the exit of the process is waited
+HANDLE native_open_process(DWORD id)
+{
+   return ::OpenProcess(SYNCHRONIZE, FALSE, id);
+}
+
+HANDLE native_create_event(BOOL signaled)
+{
+   return ::CreateEvent(NULL, TRUE, signaled, NULL);
+}
+
+void native_set_event(HANDLE event)
+{
+   ::SetEvent( event );
+}
+
+void native_reset_event(HANDLE event)
+{
+   ::ResetEvent( event );
+}
+
+void native_close_handle(HANDLE handle)
+{
+   ::CloseHandle( handle );
+}
+
+HANDLE native_create_timer()
+{
+   return ::CreateWaitableTimer(NULL, TRUE, NULL);
+}
+
+BOOL native_set_timer(HANDLE timer, const LARGE_INTEGER* time)
+{
+   return ::SetWaitableTimer(timer, time, 0, NULL, NULL, TRUE);
+}
+
+bool native_watch_object(HANDLE* wait, HANDLE object, WAITORTIMERCALLBACK callback, PVOID context)
+{
+   if (!::RegisterWaitForSingleObject(wait, object, callback, context, INFINITE, WT_EXECUTEONLYONCE))
+   {
+      *wait = NULL;
+      return false;
+   }
+   return true;
+}
+
+void native_unwatch_object(HANDLE wait)
+{
+   // the callback must be finished before its data is freed
+   ::UnregisterWaitEx(wait, INVALID_HANDLE_VALUE);
+}
+
+bool native_open_event(eventData& ed, size_t index, processVector& processes, const waitOptions& options)
+{
+   switch (ed.type) {
+   case EVENT_SIGNAL:   return open_signal(ed);
+   case EVENT_NOTIFY:   return open_notify(ed, index, options.quiet);
+   case EVENT_LOCK:     return open_lock(ed, options.holdLocks);
+   case EVENT_MOUNT:
+   case EVENT_UNMOUNT:
+   case EVENT_DEVICE:   return open_watch(ed);
+   default:             return false;
+   }
+}
+
+nodeState native_check_event(eventData& ed, HANDLE signaled)
+{
+   if (signaled == ed.failure)
+   {
+      // the messages sent before the exit may be not seen yet, 
+      // the reads of queued messages complete at once
+      DWORD size = 0;
+      while (EVENT_NOTIFY == ed.type && ::GetOverlappedResult(ed.object, &ed.overlapped, &size, FALSE))
+      {
+         if (match_notify(&ed.buffer[0], size, ed.data))
+         {
+            return STATE_TRUE;
+         }
+         if (!read_notify(ed))
+         {
+            break;
+         }
+      }
+      return STATE_FALSE;
+   }
+   if (EVENT_NOTIFY == ed.type)
+   {
+      DWORD size = 0;
+      if (::GetOverlappedResult(ed.object, &ed.overlapped, &size, FALSE) && 
+         match_notify(&ed.buffer[0], size, ed.data))
+      {
+         return STATE_TRUE;
+      }
+      // waiting for the next message
+      return read_notify(ed) ? STATE_PENDING : STATE_FALSE;
+   }
+   if (EVENT_LOCK == ed.type)
+   {
+      DWORD size = 0;
+      ed.data |= LOCK_DONE;
+      if (!::GetOverlappedResult(ed.object, &ed.overlapped, &size, FALSE))
+      {
+         return STATE_FALSE;
+      }
+      if (LOCK_HOLD & ed.data)
+      {
+         ed.data |= LOCK_OWNED;
+      }
+      else
+      {
+         // the lock was acquired only to know it is free
+         unlock_lock(ed);
+      }
+   }
+   return STATE_TRUE;
+}
+
+// stops watching the event which can no longer change the result
+void native_release_event(eventData& ed)
+{
+   if (EVENT_SIGNAL == ed.type && SIGNAL_NAMED != ed.data)
+   {
+      // the next signal interrupts the wait
+      ctrlSignals[ ed.data ] = NULL;
+   }
+   else if (EVENT_LOCK == ed.type && NULL != ed.object)
+   {
+      if (!(LOCK_DONE & ed.data))
+      {
+         // the request is cancelled, the lock granted meanwhile is given back
+         DWORD size = 0;
+         ::CancelIo( ed.object );
+         if (::GetOverlappedResult(ed.object, &ed.overlapped, &size, TRUE))
+         {
+            unlock_lock(ed);
+         }
+         ed.data |= LOCK_DONE;
+      }
+      else if ((LOCK_OWNED & ed.data) && !(LOCK_HOLD & ed.data))
+      {
+         unlock_lock(ed);
+         ed.data &= ~LOCK_OWNED;
+      }
+   }
+}
+
+void native_close_event(eventData& ed)
+{
+   if (NULL != ed.object)
+   {
+      ::CancelIo( ed.object );
+      ::CloseHandle( ed.object );
+      ed.object = NULL;
+   }
+   if (NULL != ed.failure)
+   {
+      ::CloseHandle( ed.failure );
+      ed.failure = NULL;
+   }
+   if (NULL != ed.handle)
+   {
+      ::CloseHandle( ed.handle );
+      ed.handle = NULL;
+   }
+}
+
+void native_stop_events()
+{
+   stop_watcher();
+   for (size_t index = 0; index < sizeof(ctrlSignals) / sizeof(ctrlSignals[0]); index++)
+   {
+      ctrlSignals[index] = NULL;
+   }
+}
+
+HANDLE native_open_control()
+{
+   ctrlEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+   if (NULL == ctrlEvent)
+   {
+      return NULL;
+   }
+   ::SetConsoleCtrlHandler(ctrl_handler, TRUE);
+   return ctrlEvent;
+}
+
+int native_control_code()
+{
+   return ctrlCode;
+}
+
+void native_close_control()
+{
+   if (NULL != ctrlEvent)
+   {
+      ::CloseHandle( ctrlEvent );
+      ctrlEvent = NULL;
+   }
+}
+
+DWORD native_wait(DWORD count, const HANDLE* handles, DWORD timeout)
+{
+   return ::WaitForMultipleObjects(count, handles, FALSE, timeout);
+}
+
+bool native_open_port()
+{
+   waitPort = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+   return (NULL != waitPort);
+}
+
+bool native_port_register(HANDLE* wait, HANDLE handle, size_t slot)
+{
+   if (NULL != *wait)
+   {
+      ::UnregisterWaitEx(*wait, NULL);
+      *wait = NULL;
+   }
+   if (!::RegisterWaitForSingleObject(wait, handle, port_callback, reinterpret_cast<PVOID>(slot), INFINITE, WT_EXECUTEONLYONCE))
+   {
+      *wait = NULL;
+      return false;
+   }
+   return true;
+}
+
+DWORD native_port_wait(DWORD timeout)
+{
+   DWORD bytes;
+   ULONG_PTR key;
+   LPOVERLAPPED overlapped;
+   
+   if (!::GetQueuedCompletionStatus(waitPort, &bytes, &key, &overlapped, timeout))
+   {
+      return (WAIT_TIMEOUT == ::GetLastError()) ? WAIT_TIMEOUT : WAIT_FAILED;
+   }
+   return WAIT_OBJECT_0 + static_cast<DWORD>(key);
+}
+
+void native_port_unregister(HANDLE wait)
+{
+   // the callbacks must be finished before the handles are closed
+   ::UnregisterWaitEx(wait, INVALID_HANDLE_VALUE);
+}
+
+void native_close_port()
+{
+   if (NULL != waitPort)
+   {
+      ::CloseHandle( waitPort );
+      waitPort = NULL;
+   }
+}
+
+const systemInterface nativeSystem = {
+   native_get_local_time,
+   native_get_time,
+   get_processes,
+   native_open_process,
+   native_create_event,
+   native_set_event,
+   native_reset_event,
+   native_close_handle,
+   native_create_timer,
+   native_set_timer,
+   native_watch_object,
+   native_unwatch_object,
+   native_open_event,
+   start_watcher,
+   native_check_event,
+   native_release_event,
+   native_close_event,
+   native_stop_events,
+   native_open_control,
+   native_control_code,
+   native_close_control,
+   native_wait,
+   native_open_port,
+   native_port_register,
+   native_port_wait,
+   native_port_unregister,
+   native_close_port
+};
+
+runningVector runningList;
+
+VOID CALLBACK running_callback(PVOID context, BOOLEAN timedOut)
+{
+   runningProcess* rp = static_cast<runningProcess*>(context);
+   runningData* rd = rp->data;
+   ::InterlockedExchange( &rp->exited, 1 );
+   if (::InterlockedDecrement( &rd->count ) < rd->limit)
+   {
+      rd->sys->set_event( rd->event );
+   }
+}
+
+// compares the file name of the image with the name, the .exe extension may be omitted
+bool is_image_name(const std::wstring& imageName, const std::wstring& name)
+{
+   size_t pos = imageName.find_last_of(L"\\/");
+   const wchar_t* file = imageName.c_str() + ((std::wstring::npos == pos) ? 0 : pos + 1);
+   size_t len = wcslen(file);
+   
+   profile.comparisons++;
+   if (len == name.size())
+   {
+      return (0 == _wcsicmp(file, name.c_str()));
+   }
+   return (len == name.size() + 4 && 0 == _wcsicmp(file + name.size(), L".exe") && 
+      0 == _wcsnicmp(file, name.c_str(), name.size()));
+}
+
+void close_running_process(const systemInterface& sys, runningProcess* rp)
+{
+   sys.unwatch_object( rp->wait );
+   sys.close_handle( rp->process );
+   delete rp;
+}
+
+// counts the matching processes which are not counted yet, the process which exit
+// cannot be watched is not counted
+void add_running(runningData& rd, const processVector& processes)
+{
+   // the id of the exited process can be reused once its handle is closed, 
+   // while the handle is open the id belongs to the counted process
+   runningProcessVector::iterator last = rd.processes.begin();
+   for (runningProcessVector::iterator pit = rd.processes.begin(); pit != rd.processes.end(); pit++)
+   {
+      if (0 != (*pit)->exited)
+      {
+         close_running_process(*rd.sys, *pit);
+      }
+      else
+      {
+         *last++ = *pit;
+      }
+   }
+   rd.processes.erase(last, rd.processes.end());
+
+   for (processVector::const_iterator it = processes.begin(); it != processes.end(); it++)
+   {
+      if (!is_image_name(it->imageName, rd.name))
+      {
+         continue;
+      }
+      bool counted = false;
+      for (runningProcessVector::const_iterator pit = rd.processes.begin(); pit != rd.processes.end() && !counted; pit++)
+      {
+         counted = ((*pit)->id == it->id);
+      }
+      if (counted)
+      {
+         continue;
+      }
+      HANDLE process = rd.sys->open_process( it->id );
+      if (NULL == process)
+      {
+         continue;
+      }
+      
+      // counted before the callback can decrement it
+      runningProcess* rp = new runningProcess(&rd, it->id, process);
+      ::InterlockedIncrement( &rd.count );
+      if (!rd.sys->watch_object(&rp->wait, process, running_callback, rp))
+      {
+         ::InterlockedDecrement( &rd.count );
+         rd.sys->close_handle( process );
+         delete rp;
+         continue;
+      }
+      rd.processes.push_back( rp );
+      profile.objects++;
+   }
+}
+
+bool open_running(const systemInterface& sys, eventData& ed, const processVector& processes, bool quiet)
+{
+   ed.handle = sys.create_event(FALSE);
+   if (NULL == ed.handle)
+   {
+      return false;
+   }
+   
+   runningData* rd = new runningData( static_cast<LONG>(ed.data), ed.handle, &sys );
+   runningList.push_back( rd );
+   
+   // the name is trimmed like the process name
+   std::wstring part( ed.text, 0, ed.text.rfind(L':') );
+   size_t first = part.find_first_not_of(L" \t");
+   size_t last = part.find_last_not_of(L" \t");
+   if (std::wstring::npos != first)
+   {
+      rd->name = part.substr(first, last - first + 1);
+   }
+   
+   add_running(*rd, processes);
+   if (!quiet)
+   {
+      wprintf(L"Process %s: %u running, limit %u\r\n", rd->name.c_str(), 
+         static_cast<unsigned>(rd->count), static_cast<unsigned>(rd->limit));
+   }
+   if (rd->count < rd->limit)
+   {
+      sys.set_event( rd->event );
+   }
+   return true;
+}
+
+// the counter dropped below the limit, the processes started since the last count
+// are counted before the event is accepted
+nodeState check_running(const systemInterface& sys, eventData& ed)
+{
+   runningVector::iterator it = runningList.begin();
+   while (it != runningList.end() && (*it)->event != ed.handle) it++;
+   if (it == runningList.end())
+   {
+      return STATE_FALSE;
+   }
+   
+   // the exit after the reset sets the event again
+   runningData* rd = *it;
+   sys.reset_event( rd->event );
+   
+   processVector processes;
+   profile_enter(PHASE_PROCESSES);
+   sys.get_processes( processes );
+   profile_enter(PHASE_FIND);
+   add_running(*rd, processes);
+   profile_enter(PHASE_ENGINE);
+   
+   return (rd->count < rd->limit) ? STATE_TRUE : STATE_PENDING;
+}
+
+void close_running(const systemInterface& sys)
+{
+   for (runningVector::iterator it = runningList.begin(); it != runningList.end(); it++)
+   {
+      runningData* rd = *it;
+      for (runningProcessVector::iterator pit = rd->processes.begin(); pit != rd->processes.end(); pit++)
+      {
+         close_running_process(sys, *pit);
+      }
+      delete rd;
+   }
+   runningList.clear();
+}
+
+// creates handles of the events, the process and time events are made of 
+// the system primitives, the rest is opened by the system itself
+// port - time events get no timers, their absolute deadlines are kept in data
+int open_events(const systemInterface& sys, eventVector& events, const waitOptions& options, bool port)
+{
+   processVector processes;
+   ULONGLONG now = sys.get_time();
+   
+   for (eventVector::iterator it = events.begin(); it != events.end(); it++)
+   {
+      if ((EVENT_PROCESS == it->type || EVENT_RUNNING == it->type) && processes.empty())
+      {
+         profile_enter(PHASE_PROCESSES);
+         sys.get_processes( processes );
+         profile_enter(PHASE_HANDLES);
+      }
+      
+      if (EVENT_PROCESS == it->type)
+      {
+         profile_enter(PHASE_FIND);
+         processInfo* pi = find_process_info( it->text.c_str(), static_cast<DWORD>(it->data), processes );
+         profile_enter(PHASE_HANDLES);
+         if (NULL == pi)
+         {
+            if (!options.quiet)
+            {
+               wprintf(L"Process %s not found\r\n", it->text.c_str());
+            }
+            it->text += L" (not found)";
+         }
+         else
+         {
+            if (!options.quiet)
+            {
+               wprintf(L"Process %s found as: %s (%u)\r\n", it->text.c_str(), pi->imageName.c_str(), pi->id);
+            }
+            it->text += L" (";
+            it->text += pi->imageName;
+            it->text += L")";
+            
+            it->handle = sys.open_process( pi->id );
+         }
+         if (NULL == it->handle)
+         {
+            it->handle = sys.create_event(TRUE);
+            if (NULL == it->handle)
+            {
+               return RETURNCODE_ERROR;
+            }
+         }
+      }
+      else if (EVENT_TIMEDELTA == it->type || EVENT_TIME == it->type)
+      {
+         LARGE_INTEGER time;
+         if (EVENT_TIME == it->type)
+         {
+            time.QuadPart = it->data;
+         }
+         else
+         {
+            time.QuadPart = now + it->data;
+         }
+         
+         if (port)
+         {
+            it->data = time.QuadPart;
+            continue;
+         }
+         
+         it->handle = sys.create_timer();
+         if (NULL == it->handle)
+         {
+            return RETURNCODE_ERROR;
+         }
+         if (!sys.set_timer(it->handle, &time))
+         {
+            return RETURNCODE_ERROR;
+         }
+      }
+      else if (EVENT_RUNNING == it->type)
+      {
+         profile_enter(PHASE_FIND);
+         bool opened = open_running(sys, *it, processes, options.quiet);
+         profile_enter(PHASE_HANDLES);
+         if (!opened)
+         {
+            return RETURNCODE_ERROR;
+         }
+      }
+      else
+      {
+         if (!sys.open_event(*it, it - events.begin(), processes, options))
+         {
+            return RETURNCODE_ERROR;
+         }
+      }
+   }
+   
+   return sys.start_events() ? 0 : RETURNCODE_ERROR;
+}
+
+// waits till the expression is decided, objects - maximum number of waited handles
+int wait_events(const systemInterface& sys, eventVector& events, nodeVector& nodes, size_t root, 
+   const waitOptions& options, HANDLE control, bool port, size_t objects)
+{
+   std::vector<HANDLE> handles( objects + 1 );
+   indexVector indexes( objects );
+   indexVector released;
+   std::vector<HANDLE> waits( objects + 2, static_cast<HANDLE>(NULL) );
+   size_t index, count = 0;
+   bool collect = true;
+   DWORD code;
+   int rc = 0;
+   
+   // the port waits for the nearest deadline with one absolute timer instead of timers 
+   // of the events, it is registered after the other objects and set again when the 
+   // nearest deadline changes
+   std::vector< std::pair<ULONGLONG, size_t> > deadlines;
+   size_t deadline = 0;
+   HANDLE clock = NULL;
+   ULONGLONG armed = 0;
+   for (index = 0; index < events.size(); index++)
+   {
+      if (NULL == events[index].handle && (EVENT_TIMEDELTA == events[index].type || EVENT_TIME == events[index].type))
+      {
+         deadlines.push_back( std::make_pair(events[index].data, index) );
+      }
+   }
+   std::sort(deadlines.begin(), deadlines.end());
+   if (!deadlines.empty())
+   {
+      clock = sys.create_timer();
+      if (NULL == clock)
+      {
+         return RETURNCODE_ERROR;
+      }
+   }
+   
+   while (STATE_PENDING == nodes[root].state)
+   {
+      // the expression true only thanks to a negation is accepted 
+      // when no other event is signaled, so the events already occurred are seen
+      DWORD timeout = nodes[root].value ? 0 : INFINITE;
+      
+      // wait only for events which still can change the result,
+      // the port keeps its registrations so the list is collected once
+      if (collect)
+      {
+         count = 0;
+         for (index = 0; index < events.size(); index++)
+         {
+            if (nodes[ events[index].node ].active && NULL != events[index].handle)
+            {
+               handles[count] = events[index].handle;
+               indexes[count] = index;
+               count++;
+               if (NULL != events[index].failure)
+               {
+                  handles[count] = events[index].failure;
+                  indexes[count] = index;
+                  count++;
+               }
+            }
+         }
+         handles[count] = control;
+         
+         if (port)
+         {
+            for (index = 0; index <= count; index++)
+            {
+               if (!sys.port_register(&waits[index], handles[index], index))
+               {
+                  break;
+               }
+            }
+            if (index <= count)
+            {
+               rc = RETURNCODE_ERROR;
+               break;
+            }
+         }
+         collect = !port;
+      }
+      
+      // the passed deadline is taken before the port is waited,
+      // so it is seen by the check of the expression true only thanks to a negation
+      size_t signaled = NO_NODE;
+      while (deadline < deadlines.size() && !nodes[ events[ deadlines[deadline].second ].node ].active)
+      {
+         deadline++;
+      }
+      if (deadline < deadlines.size())
+      {
+         ULONGLONG now = sys.get_time();
+         if (deadlines[deadline].first <= now)
+         {
+            signaled = deadlines[deadline].second;
+            deadline++;
+         }
+         else if (armed != deadlines[deadline].first)
+         {
+            // setting resets the timer, the registration is renewed to post its next signal
+            LARGE_INTEGER time;
+            time.QuadPart = deadlines[deadline].first;
+            if (!sys.set_timer(clock, &time) || !sys.port_register(&waits[count + 1], clock, count + 1))
+            {
+               rc = RETURNCODE_ERROR;
+               break;
+            }
+            armed = deadlines[deadline].first;
+         }
+      }
+      
+      if (NO_NODE == signaled)
+      {
+         profile_enter(PHASE_WAIT);
+         if (port)
+         {
+            code = sys.port_wait(timeout);
+         }
+         else
+         {
+            code = sys.wait(static_cast<DWORD>(count) + 1, &handles[0], timeout);
+         }
+         profile_enter(PHASE_ENGINE);
+         if (WAIT_TIMEOUT == code)
+         {
+            break;
+         }
+         profile.wakeups++;
+         
+         index = code - WAIT_OBJECT_0;
+         WAIT_PROBE("Wakeup", index);
+         if (NULL != clock && index == count + 1)
+         {
+            // the deadline is taken by the next pass, or the timer is set again
+            armed = 0;
+            continue;
+         }
+         if (index > count)
+         {
+            rc = RETURNCODE_ERROR;
+            break;
+         }
+         if (index == count)
+         {
+            rc = sys.control_code();
+            if (!options.quiet) print_special(rc);
+            break;
+         }
+         signaled = indexes[index];
+      }
+      
+      eventData& ed = events[signaled];
+      if (!nodes[ ed.node ].active)
+      {
+         // the port delivers signals of events which are not needed anymore
+         continue;
+      }
+      
+      nodeState state;
+      if (NULL == ed.handle)
+      {
+         state = STATE_TRUE;
+      }
+      else if (EVENT_RUNNING == ed.type)
+      {
+         state = check_running( sys, ed );
+      }
+      else
+      {
+         state = sys.check_event( ed, handles[index] );
+      }
+      if (STATE_PENDING != state)
+      {
+         if (!options.quiet) print_event( &ed, state );
+         
+         decide_node( nodes, ed.node, state, released );
+         WAIT_PROBE("Event", signaled);
+      }
+      else if (port && !sys.port_register(&waits[index], handles[index], index))
+      {
+         rc = RETURNCODE_ERROR;
+         break;
+      }
+      
+      for (indexVector::iterator it = released.begin(); it != released.end(); it++)
+      {
+         sys.release_event( events[*it] );
+      }
+      released.clear();
+      
+      // the system terminates the program after these signals, 
+      // so they end the wait when it would go on
+      if (EVENT_SIGNAL == ed.type && STATE_PENDING == nodes[root].state && !nodes[root].value &&
+         (CTRL_CLOSE_EVENT == ed.data || CTRL_LOGOFF_EVENT == ed.data || CTRL_SHUTDOWN_EVENT == ed.data))
+      {
+         switch (ed.data) {
+         case CTRL_CLOSE_EVENT:  rc = RETURNCODE_CLOSE; break;
+         case CTRL_LOGOFF_EVENT: rc = RETURNCODE_LOGOFF; break;
+         default:                rc = RETURNCODE_SHUTDOWN; break;
+         }
+         if (!options.quiet) print_special(rc);
+         break;
+      }
+   }
+   profile_enter(PHASE_EXIT);
+   
+   for (std::vector<HANDLE>::iterator it = waits.begin(); it != waits.end(); it++)
+   {
+      if (NULL != *it)
+      {
+         sys.port_unregister( *it );
+      }
+   }
+   if (NULL != clock)
+   {
+      sys.close_handle( clock );
+   }
+   
+   if (0 == rc && nodes[root].value)
+   {
+      rc = (NODE_OR == nodes[root].type) ? static_cast<int>( node_branch(nodes, root) ) : 0;
+   }
+   else if (0 == rc && STATE_FALSE == nodes[root].state)
+   {
+      rc = RETURNCODE_UNSATISFIED;
+      if (!options.quiet) print_special(rc);
+   }
+   return rc;
+}
+
+// runs the wait for the expression with the root node, the events stay open 
+// till close_events, so the held locks are kept
+int run_engine(const systemInterface& sys, eventVector& events, nodeVector& nodes, size_t root, const waitOptions& options)
+{
+   // launched notify commands are waited as well
+   size_t objects = events.size();
+   for (eventVector::iterator it = events.begin(); it != events.end(); it++)
+   {
+      if (EVENT_NOTIFY == it->type && !(NOTIFY_EXTERNAL & it->data))
+      {
+         objects++;
+      }
+   }
+   
+   // the completion port has no limit on number of objects, 
+   // WaitForMultipleObjects is used when the port is not available
+   bool over_limit = (events.size() > 32 || objects >= MAXIMUM_WAIT_OBJECTS);
+   bool port = false;
+   if (options.usePort || over_limit)
+   {
+      port = sys.open_port();
+   }
+   
+   if (!port && over_limit)
+   {
+      if (!options.quiet)
+      {
+         print_limit();
+      }
+      return (-static_cast<int>(events.size()));
+   }
+   
+   {
+      std::vector<bool> visited( nodes.size(), false );
+      init_node( nodes, root, visited );
+   }
+   
+   // creating handles
+   profile_enter(PHASE_HANDLES);
+   HANDLE control = sys.open_control();
+   int rc = (NULL == control) ? RETURNCODE_ERROR : open_events(sys, events, options, port);
+   
+   for (eventVector::iterator it = events.begin(); it != events.end(); it++)
+   {
+      if (NULL != it->handle) profile.objects++;
+      if (NULL != it->failure) profile.objects++;
+      if (NULL != it->object) profile.objects++;
+   }
+   WAIT_PROBE("Objects", profile.objects);
+   
+   // execution
+   profile_enter(PHASE_ENGINE);
+   if (0 == rc)
+   {
+      rc = wait_events(sys, events, nodes, root, options, control, port, objects);
+   }
+   
+   if (port)
+   {
+      sys.close_port();
+   }
+   return rc;
+}
+
+// marks nodes which make the expression true, the negation is true without its operand
+void mark_relevant(const nodeVector& nodes, size_t index, std::vector<bool>& relevant)
+{
+   relevant[index] = true;
+   if (NODE_NOT != nodes[index].type)
+   {
+      for (indexVector::const_iterator it = nodes[index].children.begin(); it != nodes[index].children.end(); it++)
+      {
+         if (nodes[*it].value && !relevant[*it])
+         {
+            mark_relevant( nodes, *it, relevant );
+         }
+      }
+   }
+}
+
+// keeps only the held locks which make the expression true, the pending lock requests are 
+// cancelled and other acquired locks are unlocked
+void release_locks(const systemInterface& sys, eventVector& events, const nodeVector& nodes, size_t root)
+{
+   std::vector<bool> relevant( nodes.size(), false );
+   if (nodes[root].value)
+   {
+      mark_relevant( nodes, root, relevant );
+   }
+   
+   for (eventVector::iterator it = events.begin(); it != events.end(); it++)
+   {
+      if (EVENT_LOCK == it->type)
+      {
+         if (!relevant[ it->node ])
+         {
+            it->data &= ~LOCK_HOLD;
+         }
+         sys.release_event( *it );
+      }
+   }
+}
+
+void close_events(const systemInterface& sys, eventVector& events)
+{
+   sys.stop_events();
+   close_running(sys);
+   for (eventVector::iterator it = events.begin(); it != events.end(); it++)
+   {
+      sys.close_event( *it );
+   }
+   sys.close_control();
+}
+
+// the whole program except the profiling, every return passes through wmain
+int run_wait(int argc, wchar_t *argv[])
+{
+   SYSTEMTIME  current_stime;
+   bool        quiet       = false;
+   bool        wait_all    = false;
+   bool        use_port    = false;
+   bool        hold_locks  = false;
+   std::wstring command;
+   int         arg_state   = ARGSTATE_NONE;
+   eventVector events;
+   nodeVector  nodes;
+   indexVector operands;
+   const wchar_t* bad_expr = NULL;
+   bool        show_help   = false;
+   
+   nativeSystem.get_local_time( &current_stime );
+   
+   for (int argi = 0; argi < argc; argi++)
+   {
+      const wchar_t* arg = argv[ argi ];
+      if (!arg) continue;      
+   
+      if (ARGSTATE_EXPRESSION == arg_state)
+      {
+         size_t node = parse_expression(arg, &current_stime, events, nodes);
+         if (NO_NODE == node)
+         {
+            if (!bad_expr) bad_expr = arg;
+         }
+         else
+         {
+            operands.push_back( node );
+         }
+         arg_state = ARGSTATE_NONE;
+      }
+      else if (ARGSTATE_NONE != arg_state)
+      {
+         eventType type;
+         switch (arg_state) {
+         case ARGSTATE_TIME:     type = EVENT_TIME; break;
+         case ARGSTATE_PROCESS:  type = EVENT_PROCESS; break;
+         case ARGSTATE_SIGNAL:   type = EVENT_SIGNAL; break;
+         case ARGSTATE_NOTIFY:   type = EVENT_NOTIFY; break;
+         case ARGSTATE_LOCK:     type = EVENT_LOCK; break;
+         case ARGSTATE_MOUNT:    type = EVENT_MOUNT; break;
+         case ARGSTATE_UNMOUNT:  type = EVENT_UNMOUNT; break;
+         case ARGSTATE_DEVICE:   type = EVENT_DEVICE; break;
+         case ARGSTATE_RUNNING:  type = EVENT_RUNNING; break;
+         default:                type = EVENT_TIMEDELTA; break;
+         }
+         
+         size_t node = add_event_node(type, arg, &current_stime, events, nodes);
+         if (NO_NODE != node)
+         {
+            operands.push_back( node );
+         }
+         arg_state = ARGSTATE_NONE;
+      }
+      else if (0 == wcscmp(arg, L"--"))
+      {
+         // the rest is the command to run when the wait is over
+         for (argi++; argi < argc; argi++)
+         {
+            if (argv[ argi ])
+            {
+               append_argument(command, argv[ argi ]);
+            }
+         }
+         break;
+      }
+      else
+      {
+         bool long_options = false;
+         if (L'-' == *arg)
+         {
+            arg++;
+            if (L'-' == *arg)
+            {
+               long_options = true;
+               arg++;
+            }
+         }
+         else if (L'/' == *arg)
+         {
             arg++;
          }
          else
@@ -634,7 +3048,7 @@ int wmain(int argc, wchar_t *argv[])
             {
                if (0 == _wcsicmp(arg, L"help"))
                {
-                  events.clear();
+                  show_help = true;
                   break;
                }
                else if (0 == _wcsicmp(arg, L"delta"))
@@ -649,6 +3063,42 @@ int wmain(int argc, wchar_t *argv[])
                {
                   arg_state = ARGSTATE_PROCESS;
                }
+               else if (0 == _wcsicmp(arg, L"signal"))
+               {
+                  arg_state = ARGSTATE_SIGNAL;
+               }
+               else if (0 == _wcsicmp(arg, L"notify"))
+               {
+                  arg_state = ARGSTATE_NOTIFY;
+               }
+               else if (0 == _wcsicmp(arg, L"lock"))
+               {
+                  arg_state = ARGSTATE_LOCK;
+               }
+               else if (0 == _wcsicmp(arg, L"mount"))
+               {
+                  arg_state = ARGSTATE_MOUNT;
+               }
+               else if (0 == _wcsicmp(arg, L"unmount"))
+               {
+                  arg_state = ARGSTATE_UNMOUNT;
+               }
+               else if (0 == _wcsicmp(arg, L"device"))
+               {
+                  arg_state = ARGSTATE_DEVICE;
+               }
+               else if (0 == _wcsicmp(arg, L"max-running"))
+               {
+                  arg_state = ARGSTATE_RUNNING;
+               }
+               else if (0 == _wcsicmp(arg, L"hold"))
+               {
+                  hold_locks = true;
+               }
+               else if (0 == _wcsicmp(arg, L"expr"))
+               {
+                  arg_state = ARGSTATE_EXPRESSION;
+               }
                else if (0 == _wcsicmp(arg, L"all"))
                {
                   wait_all = true;
@@ -657,12 +3107,20 @@ int wmain(int argc, wchar_t *argv[])
                {
                   quiet = true;
                }
+               else if (0 == _wcsicmp(arg, L"profile"))
+               {
+                  profile.enabled = true;
+               }
+               else if (0 == _wcsicmp(arg, L"port"))
+               {
+                  use_port = true;
+               }
             }
             else
             {
                if (L'h' == *arg || L'H' == *arg || L'?' == *arg)
                {
-                  events.clear();
+                  show_help = true;
                   break;
                }
                else if (L'd' == *arg || L'D' == *arg)
@@ -677,6 +3135,38 @@ int wmain(int argc, wchar_t *argv[])
                {
                   arg_state = ARGSTATE_PROCESS;
                }
+               else if (L's' == *arg || L'S' == *arg)
+               {
+                  arg_state = ARGSTATE_SIGNAL;
+               }
+               else if (L'n' == *arg || L'N' == *arg)
+               {
+                  arg_state = ARGSTATE_NOTIFY;
+               }
+               else if (L'l' == *arg || L'L' == *arg)
+               {
+                  arg_state = ARGSTATE_LOCK;
+               }
+               else if (L'm' == *arg || L'M' == *arg)
+               {
+                  arg_state = ARGSTATE_MOUNT;
+               }
+               else if (L'u' == *arg || L'U' == *arg)
+               {
+                  arg_state = ARGSTATE_UNMOUNT;
+               }
+               else if (L'v' == *arg || L'V' == *arg)
+               {
+                  arg_state = ARGSTATE_DEVICE;
+               }
+               else if (L'r' == *arg || L'R' == *arg)
+               {
+                  arg_state = ARGSTATE_RUNNING;
+               }
+               else if (L'e' == *arg || L'E' == *arg)
+               {
+                  arg_state = ARGSTATE_EXPRESSION;
+               }
                else if (L'a' == *arg || L'A' == *arg)
                {
                   wait_all = true;
@@ -690,171 +3180,61 @@ int wmain(int argc, wchar_t *argv[])
       }      
    }
 
-   if (events.empty())
-   {
-      print_help();
-      return RETURNCODE_HELP;
-   }
-   
-   if (events.size() > 32)
+   // the invalid expression is reported even when it is the only operand
+   if (bad_expr && !show_help)
    {
       if (!quiet)
       {
-         print_limit();
+         print_expression_error(bad_expr);
       }
-      return (-static_cast<int>(events.size()));
-   }
-
-   int rc = 0;
-
-   // creating handles
-   ctrlEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
-   if (NULL == ctrlEvent)
-   {
-      rc = RETURNCODE_ERROR;
+      return RETURNCODE_ERROR;
    }
-   else   
+   
+   if (show_help || operands.empty())
    {
-      processVector processes;
-      for (eventVector::iterator it = events.begin(); it != events.end(); it++)
-      {
-         if (EVENT_PROCESS == it->type)
-         {
-            if (processes.empty())
-            {
-               get_processes( processes );
-            }
-            processInfo* pi = find_process_info( it->text.c_str(), static_cast<DWORD>(it->data), processes );
-            if (NULL == pi)
-            {
-               if (!quiet)
-               {
-                  wprintf(L"Process %s not found\r\n", it->text.c_str());
-               }
-               it->text += L" (not found)";
-            }
-            else
-            {
-               if (!quiet)
-               {
-                  wprintf(L"Process %s found as: %s (%u)\r\n", it->text.c_str(), pi->imageName.c_str(), pi->id);
-               }
-               it->text += L" (";
-               it->text += pi->imageName;
-               it->text += L")";
-               
-               it->handle = ::OpenProcess(PROCESS_ALL_ACCESS, FALSE, pi->id);
-            }
-            if (NULL == it->handle)
-            {
-               it->handle = ::CreateEvent(NULL, TRUE, TRUE, NULL);
-               if (NULL == it->handle)
-               {
-                  rc = RETURNCODE_ERROR;
-                  break;
-               }
-            }
-         }
-         else
-         {
-            it->handle = ::CreateWaitableTimer(NULL, TRUE, NULL);
-            if (NULL == it->handle)
-            {
-               rc = RETURNCODE_ERROR;
-               break;
-            }
-            
-            LARGE_INTEGER time;
-            if (EVENT_TIME == it->type)
-            {
-               time.QuadPart = it->data;
-            }
-            else
-            {
-               time.QuadPart = current_ftime + it->data;
-            }
-            
-            if (!::SetWaitableTimer(it->handle, &time, 0, NULL, NULL, TRUE))
-            {
-               rc = RETURNCODE_ERROR;
-               break;
-            }
-         }
-      }
+      print_help();
+      return RETURNCODE_HELP;
    }
    
-   // execution
-   if (0 == rc)
-   {
-      HANDLE* handles = new HANDLE[events.size() + 1];
-      if (NULL == handles)
-      {
-         rc = RETURNCODE_ERROR;
-      }
-      else
-      {
-         indexVector indexes;
-         size_t index, count = events.size();
-         DWORD code;
-         
-         for (index = 0; index < count; index++)
-         {
-            handles[index] = events[index].handle;
-            indexes.push_back(index);
-         }
-         handles[count] = ctrlEvent;
-      
-         ::SetConsoleCtrlHandler(ctrl_handler, TRUE);
-         
-         while (count > 0)
-         {
-            code = ::WaitForMultipleObjects(static_cast<DWORD>(count) + 1, handles, FALSE, INFINITE);
-            if (code >= WAIT_OBJECT_0)
-            {
-               index = code - WAIT_OBJECT_0;
-               if (index >= count)
-               {
-                  rc = ctrlCode;
-                  if (!quiet) print_special(rc);
-                  break;
-               }
+   size_t root = link_operands(nodes, operands, wait_all);
 
-               if (!quiet) print_event( &events[ indexes[index] ] );
-               
-               if (!wait_all)
-               {
-                  rc = static_cast<int>( index );
-                  break;
-               }
-
-               memmove(&handles[index], &handles[index + 1], (count - index) * sizeof(HANDLE));
-               indexes.erase( indexes.begin() + index );
-               count--;
-            }
-         }
-         
-         delete[] handles;
-      }
-   }
+   waitOptions options = { quiet, hold_locks, use_port };
+   int rc = run_engine(nativeSystem, events, nodes, root, options);
 
-   // clean up handles
-   for (eventVector::iterator it = events.begin(); it != events.end(); it++)
+   // the command runs while the held locks are still owned
+   if (rc >= 0 && !command.empty())
    {
-      ::CloseHandle( it->handle );
-      it->handle = NULL;
+      release_locks( nativeSystem, events, nodes, root );
+      profile_enter(PHASE_COMMAND);
+      rc = run_command( command );
+      profile_enter(PHASE_EXIT);
    }
+   close_events(nativeSystem, events);
    
-   if (NULL != ctrlEvent)
+   if (RETURNCODE_ERROR == rc && (!quiet))
    {
-      ::CloseHandle(ctrlEvent);
-      ctrlEvent = NULL;
+      print_handle_error();
    }
+   return rc;
+}
+
+// the test program includes this file with its own entry point
+#ifndef WAIT_NO_MAIN
+int wmain(int argc, wchar_t *argv[])
+{
+   profile.start = profile_counter();
+   WAIT_PROBE_REGISTER();
    
-   if (RETURNCODE_ERROR == rc && (!quiet))
+   int rc = run_wait(argc, argv);
+   
+   profile_enter(PHASE_COUNT);
+   WAIT_PROBE("Exit", rc);
+   WAIT_PROBE_UNREGISTER();
+   if (profile.enabled)
    {
-      print_handle_error();
+      print_profile();
    }
 
 	return rc;
 }
-
+#endif
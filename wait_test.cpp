@@ -0,0 +1,1321 @@
+// Tests of the wait engine. The engine is driven by the simulated system: the virtual
+// clock jumps to the next scripted event, processes are born and exit by the script.
+// The random scenarios are checked against the reference evaluation of the expression.
+//
+// Usage: wait_test [<number of random scenarios>]
+// The program returns 0 when all tests pass.
+//
+// Usage: wait_test --bench
+// Measures setup time and wake latency of the native engine at 10, 1000 and 100000 events
+// with WaitForMultipleObjects and with the completion port.
+
+#define WAIT_NO_MAIN
+#include "wait.cpp"
+
+#include <set>
+
+// the simulated object is never signaled
+#define SIM_NEVER             ((ULONGLONG)-1)
+
+// start of the virtual clock
+#define SIM_START             (100 * ONE_DAY)
+
+// the expression cannot be parsed
+#define RETURNCODE_PARSE      (-100)
+
+// default number of random scenarios
+#define RANDOM_SCENARIOS      (1000000)
+
+// simulated kernel object, signaled since the time
+typedef struct simObject {
+   ULONGLONG      time;
+   bool           open;
+   size_t         registration;  // the last port registration + 1, 0 if none
+
+   simObject(ULONGLONG _time) : time(_time), open(true), registration(0)
+   {
+   }
+} simObject;
+
+// scripted process, running from birth till exit
+typedef struct simProcess {
+   DWORD          id;
+   std::wstring   imageName;
+   ULONGLONG      birth;
+   ULONGLONG      exit;
+
+   simProcess(DWORD _id, const wchar_t* _imageName, ULONGLONG _birth, ULONGLONG _exit)
+      : id(_id), imageName(_imageName), birth(_birth), exit(_exit)
+   {
+   }
+} simProcess;
+
+// scripted lock file, released by its owner at the time
+typedef struct simLock {
+   std::wstring   path;
+   ULONGLONG      time;
+
+   simLock(const wchar_t* _path, ULONGLONG _time) : path(_path), time(_time)
+   {
+   }
+} simLock;
+
+// completion port registration of the object
+typedef struct simRegistration {
+   HANDLE         handle;
+   size_t         slot;
+   ULONGLONG      time;
+   bool           queued;
+   bool           active;
+} simRegistration;
+
+// callback of the signaled object, called once
+typedef struct simWatch {
+   ULONGLONG      time;
+   WAITORTIMERCALLBACK callback;
+   PVOID          context;
+} simWatch;
+
+typedef std::pair<ULONGLONG, size_t> simCallback;   // time and watch index
+
+// registered object in the completion port queue, the lower slot wins the tie like
+// the lower index in WaitForMultipleObjects
+typedef struct simKey {
+   ULONGLONG      time;
+   size_t         slot;
+   size_t         registration;
+
+   bool operator<(const simKey& other) const
+   {
+      return (time != other.time) ? (time < other.time) : (slot < other.slot);
+   }
+} simKey;
+
+typedef struct simulator {
+   ULONGLONG      now;
+   ULONGLONG      interrupt;     // time of Ctrl+C
+   ULONGLONG      signal;        // time of the signals waited as events
+   bool           portAvailable;
+   HANDLE         control;
+   std::vector<simObject>        objects;          // the handle is index + 1
+   std::vector<simProcess>       processes;
+   std::vector<simLock>          locks;
+   std::vector<simRegistration>  registrations;    // the wait handle is index + 1
+   std::set<simKey>              queue;
+   std::vector<simWatch>         watches;          // the wait handle is index + 1
+   std::set<simCallback>         callbacks;        // pending callbacks by time
+} simulator;
+
+simulator sim;
+
+void sim_reset()
+{
+   sim.now = SIM_START;
+   sim.interrupt = SIM_NEVER;
+   sim.signal = SIM_NEVER;
+   sim.portAvailable = true;
+   sim.control = NULL;
+   sim.objects.clear();
+   sim.processes.clear();
+   sim.locks.clear();
+   sim.registrations.clear();
+   sim.queue.clear();
+   sim.watches.clear();
+   sim.callbacks.clear();
+}
+
+HANDLE sim_object(ULONGLONG time)
+{
+   sim.objects.push_back( simObject(time) );
+   return reinterpret_cast<HANDLE>( sim.objects.size() );
+}
+
+simObject& sim_get(HANDLE handle)
+{
+   return sim.objects[ reinterpret_cast<size_t>(handle) - 1 ];
+}
+
+size_t sim_open_objects()
+{
+   size_t count = 0;
+   for (std::vector<simObject>::iterator it = sim.objects.begin(); it != sim.objects.end(); it++)
+   {
+      if (it->open) count++;
+   }
+   return count;
+}
+
+void sim_get_local_time(SYSTEMTIME* time)
+{
+   memset(time, 0, sizeof(SYSTEMTIME));
+   time->wYear = 2007;
+   time->wMonth = 1;
+   time->wDay = 1;
+}
+
+ULONGLONG sim_get_time()
+{
+   return sim.now;
+}
+
+void sim_get_processes(processVector& processes)
+{
+   for (std::vector<simProcess>::iterator it = sim.processes.begin(); it != sim.processes.end(); it++)
+   {
+      if (it->birth <= sim.now && sim.now < it->exit)
+      {
+         processInfo pi( it->id );
+         pi.imageName = it->imageName;
+         processes.push_back( pi );
+      }
+   }
+   profile.processes += processes.size();
+}
+
+HANDLE sim_open_process(DWORD id)
+{
+   for (std::vector<simProcess>::iterator it = sim.processes.begin(); it != sim.processes.end(); it++)
+   {
+      if (id == it->id && it->birth <= sim.now && sim.now < it->exit)
+      {
+         return sim_object( it->exit );
+      }
+   }
+   return NULL;
+}
+
+HANDLE sim_create_event(BOOL signaled)
+{
+   return sim_object( signaled ? sim.now : SIM_NEVER );
+}
+
+// the port registration waiting for the event is queued
+void sim_set_event(HANDLE event)
+{
+   simObject& object = sim_get(event);
+   if (object.time > sim.now)
+   {
+      object.time = sim.now;
+      if (0 != object.registration)
+      {
+         simRegistration& reg = sim.registrations[ object.registration - 1 ];
+         if (reg.active && !reg.queued)
+         {
+            simKey key = { sim.now, reg.slot, object.registration - 1 };
+            sim.queue.insert( key );
+            reg.time = sim.now;
+            reg.queued = true;
+         }
+      }
+   }
+}
+
+void sim_reset_event(HANDLE event)
+{
+   sim_get(event).time = SIM_NEVER;
+}
+
+void sim_close_handle(HANDLE handle)
+{
+   sim_get(handle).open = false;
+}
+
+HANDLE sim_create_timer()
+{
+   return sim_object( SIM_NEVER );
+}
+
+BOOL sim_set_timer(HANDLE timer, const LARGE_INTEGER* time)
+{
+   sim_get(timer).time = (time->QuadPart < 0) ? sim.now - time->QuadPart : time->QuadPart;
+   return TRUE;
+}
+
+bool sim_watch_object(HANDLE* wait, HANDLE object, WAITORTIMERCALLBACK callback, PVOID context)
+{
+   simWatch watch = { sim_get(object).time, callback, context };
+   if (SIM_NEVER != watch.time)
+   {
+      sim.callbacks.insert( simCallback(watch.time, sim.watches.size()) );
+   }
+   sim.watches.push_back( watch );
+   *wait = reinterpret_cast<HANDLE>( sim.watches.size() );
+   return true;
+}
+
+void sim_unwatch_object(HANDLE wait)
+{
+   size_t index = reinterpret_cast<size_t>(wait) - 1;
+   sim.callbacks.erase( simCallback(sim.watches[index].time, index) );
+}
+
+// calls the first callback due till the time, the callbacks run at their own time
+bool sim_callback(ULONGLONG time)
+{
+   if (sim.callbacks.empty() || sim.callbacks.begin()->first > time)
+   {
+      return false;
+   }
+   simCallback next = *sim.callbacks.begin();
+   sim.callbacks.erase( sim.callbacks.begin() );
+   if (next.first > sim.now)
+   {
+      sim.now = next.first;
+   }
+   sim.watches[ next.second ].callback( sim.watches[ next.second ].context, FALSE );
+   return true;
+}
+
+// signal and lock events are simulated besides process and time ones
+bool sim_open_event(eventData& ed, size_t index, processVector& processes, const waitOptions& options)
+{
+   if (EVENT_SIGNAL == ed.type)
+   {
+      ed.handle = sim_object( sim.signal );
+      return true;
+   }
+   if (EVENT_LOCK != ed.type)
+   {
+      return false;
+   }
+   for (std::vector<simLock>::iterator it = sim.locks.begin(); it != sim.locks.end(); it++)
+   {
+      if (ed.text == it->path)
+      {
+         ed.handle = sim_object( it->time );
+         if (options.holdLocks)
+         {
+            ed.data |= LOCK_HOLD;
+         }
+         return true;
+      }
+   }
+   return false;
+}
+
+bool sim_start_events()
+{
+   return true;
+}
+
+nodeState sim_check_event(eventData& ed, HANDLE signaled)
+{
+   if (EVENT_LOCK == ed.type)
+   {
+      ed.data |= (LOCK_HOLD & ed.data) ? (LOCK_DONE | LOCK_OWNED) : LOCK_DONE;
+   }
+   return STATE_TRUE;
+}
+
+// the lock granted meanwhile is given back as well, so the request is just done
+void sim_release_event(eventData& ed)
+{
+   if (EVENT_LOCK == ed.type)
+   {
+      if (!(LOCK_DONE & ed.data))
+      {
+         ed.data |= LOCK_DONE;
+      }
+      else if (!(LOCK_HOLD & ed.data))
+      {
+         ed.data &= ~LOCK_OWNED;
+      }
+   }
+}
+
+void sim_close_event(eventData& ed)
+{
+   if (NULL != ed.handle)
+   {
+      sim_get(ed.handle).open = false;
+      ed.handle = NULL;
+   }
+}
+
+void sim_stop_events()
+{
+}
+
+HANDLE sim_open_control()
+{
+   sim.control = sim_object( sim.interrupt );
+   return sim.control;
+}
+
+int sim_control_code()
+{
+   return RETURNCODE_SIGINT;
+}
+
+void sim_close_control()
+{
+   if (NULL != sim.control)
+   {
+      sim_get(sim.control).open = false;
+      sim.control = NULL;
+   }
+}
+
+// end of the wait with the timeout
+ULONGLONG sim_end(DWORD timeout)
+{
+   return (INFINITE == timeout) ? SIM_NEVER : sim.now + timeout * (ULONGLONG)ONE_MILLISECOND;
+}
+
+// the callbacks due before the object is signaled can signal another object,
+// so the caller looks for the first object again when it returns true
+bool sim_before(ULONGLONG time, ULONGLONG end)
+{
+   return sim_callback( std::min<ULONGLONG>(std::max<ULONGLONG>(time, sim.now), end) );
+}
+
+// the clock jumps to the time when the object is signaled, the deadlock fails the wait
+DWORD sim_advance(ULONGLONG time, ULONGLONG end)
+{
+   if (time <= sim.now)
+   {
+      return WAIT_OBJECT_0;
+   }
+   if (end < time)
+   {
+      sim.now = end;
+      return WAIT_TIMEOUT;
+   }
+   if (SIM_NEVER == time)
+   {
+      return WAIT_FAILED;
+   }
+   sim.now = time;
+   return WAIT_OBJECT_0;
+}
+
+DWORD sim_wait(DWORD count, const HANDLE* handles, DWORD timeout)
+{
+   ULONGLONG end = sim_end(timeout);
+   DWORD first;
+   ULONGLONG time;
+   do
+   {
+      first = 0;
+      time = SIM_NEVER;
+      for (DWORD index = 0; index < count; index++)
+      {
+         ULONGLONG signaled = sim_get( handles[index] ).time;
+         if (signaled < time)
+         {
+            time = signaled;
+            first = index;
+         }
+      }
+   }
+   while (sim_before(time, end));
+
+   DWORD code = sim_advance(time, end);
+   return (WAIT_OBJECT_0 == code) ? WAIT_OBJECT_0 + first : code;
+}
+
+bool sim_open_port()
+{
+   return sim.portAvailable;
+}
+
+void sim_port_unregister(HANDLE wait)
+{
+   simRegistration& reg = sim.registrations[ reinterpret_cast<size_t>(wait) - 1 ];
+   if (reg.queued)
+   {
+      simKey key = { reg.time, reg.slot, 0 };
+      sim.queue.erase( key );
+      reg.queued = false;
+   }
+   reg.active = false;
+}
+
+bool sim_port_register(HANDLE* wait, HANDLE handle, size_t slot)
+{
+   if (NULL != *wait)
+   {
+      sim_port_unregister( *wait );
+      *wait = NULL;
+   }
+
+   simRegistration reg = { handle, slot, sim_get(handle).time, false, true };
+   if (SIM_NEVER != reg.time)
+   {
+      simKey key = { reg.time, slot, sim.registrations.size() };
+      sim.queue.insert( key );
+      reg.queued = true;
+   }
+   sim.registrations.push_back( reg );
+   *wait = reinterpret_cast<HANDLE>( sim.registrations.size() );
+   sim_get(handle).registration = sim.registrations.size();
+   return true;
+}
+
+DWORD sim_port_wait(DWORD timeout)
+{
+   ULONGLONG end = sim_end(timeout);
+   ULONGLONG time;
+   do
+   {
+      time = sim.queue.empty() ? SIM_NEVER : sim.queue.begin()->time;
+   }
+   while (sim_before(time, end));
+
+   DWORD code = sim_advance(time, end);
+   if (WAIT_OBJECT_0 != code)
+   {
+      return code;
+   }
+
+   // the registration is executed only once
+   simKey key = *sim.queue.begin();
+   sim.queue.erase( sim.queue.begin() );
+   sim.registrations[ key.registration ].queued = false;
+   return WAIT_OBJECT_0 + static_cast<DWORD>(key.slot);
+}
+
+void sim_close_port()
+{
+}
+
+const systemInterface simSystem = {
+   sim_get_local_time,
+   sim_get_time,
+   sim_get_processes,
+   sim_open_process,
+   sim_create_event,
+   sim_set_event,
+   sim_reset_event,
+   sim_close_handle,
+   sim_create_timer,
+   sim_set_timer,
+   sim_watch_object,
+   sim_unwatch_object,
+   sim_open_event,
+   sim_start_events,
+   sim_check_event,
+   sim_release_event,
+   sim_close_event,
+   sim_stop_events,
+   sim_open_control,
+   sim_control_code,
+   sim_close_control,
+   sim_wait,
+   sim_open_port,
+   sim_port_register,
+   sim_port_wait,
+   sim_port_unregister,
+   sim_close_port
+};
+
+// test counters
+size_t testCount = 0;
+size_t testFailures = 0;
+ULONGLONG scriptedEvents = 0;
+
+std::string narrow(const std::wstring& str)
+{
+   return std::string( str.begin(), str.end() );
+}
+
+// runs the operands with the simulated system, the handles and port registrations must be
+// released after the run
+// owned - receives the locks kept for the command
+int sim_run(const std::vector<std::wstring>& operands, bool all, bool port, 
+   bool hold = false, std::wstring* owned = NULL)
+{
+   eventVector events;
+   nodeVector  nodes;
+   indexVector roots;
+   SYSTEMTIME  current;
+
+   sim_get_local_time( &current );
+   for (std::vector<std::wstring>::const_iterator it = operands.begin(); it != operands.end(); it++)
+   {
+      size_t node = parse_expression(it->c_str(), &current, events, nodes);
+      if (NO_NODE == node)
+      {
+         return RETURNCODE_PARSE;
+      }
+      roots.push_back( node );
+   }
+
+   size_t root = link_operands(nodes, roots, all);
+   waitOptions options = { true, hold, port };
+   int rc = run_engine(simSystem, events, nodes, root, options);
+   if (rc >= 0 && NULL != owned)
+   {
+      release_locks(simSystem, events, nodes, root);
+      for (eventVector::iterator it = events.begin(); it != events.end(); it++)
+      {
+         if (EVENT_LOCK == it->type && (LOCK_OWNED & it->data))
+         {
+            *owned += it->text + L" ";
+         }
+      }
+   }
+   close_events(simSystem, events);
+
+   if (0 != sim_open_objects() || !sim.queue.empty() || !sim.callbacks.empty())
+   {
+      printf("FAILED: %u objects, %u port registrations and %u callbacks are left\r\n",
+         static_cast<unsigned>(sim_open_objects()), static_cast<unsigned>(sim.queue.size()), 
+         static_cast<unsigned>(sim.callbacks.size()));
+      testFailures++;
+   }
+   return rc;
+}
+
+// the processes of the fixed test cases
+void sim_script()
+{
+   sim.processes.push_back( simProcess(100, L"C:\\app\\db.exe",     SIM_START - ONE_SECOND, SIM_START + 5 * ONE_SECOND) );
+   sim.processes.push_back( simProcess(101, L"C:\\app\\cache.exe",  SIM_START - ONE_SECOND, SIM_START + 20 * ONE_SECOND) );
+   sim.processes.push_back( simProcess(102, L"C:\\app\\setup.exe",  SIM_START - ONE_SECOND, SIM_START + 10 * ONE_MINUTE) );
+   sim.processes.push_back( simProcess(103, L"C:\\app\\server.exe", SIM_START - ONE_SECOND, SIM_NEVER) );
+   sim.processes.push_back( simProcess(104, L"C:\\app\\late.exe",   SIM_START + ONE_SECOND, SIM_START + 2 * ONE_SECOND) );
+}
+
+// fixed test case, the time of the result is relative to the start (milliseconds)
+typedef struct testCase {
+   const wchar_t* operands[3];
+   bool           all;
+   ULONGLONG      interrupt;
+   int            rc;
+   ULONGLONG      time;
+} testCase;
+
+const testCase testCases[] = {
+   { { L"p:db", L"d:10s" },                     false, 0,      0,                      5000 },
+   { { L"p:cache", L"d:10s" },                  false, 0,      1,                      10000 },
+   { { L"p:db", L"p:cache" },                   true,  0,      0,                      20000 },
+   { { L"(p:db & p:cache) | d:10m" },           false, 0,      0,                      20000 },
+   { { L"(p:db & p:server) | d:1m" },           false, 0,      1,                      60000 },
+   { { L"p:db || p:db" },                       false, 0,      0,                      5000 },
+   { { L"d:15s & !p:setup" },                   false, 0,      0,                      15000 },
+   { { L"d:15m & !p:setup" },                   false, 0,      RETURNCODE_UNSATISFIED, 600000 },
+   { { L"!p:server" },                          false, 0,      0,                      0 },
+   { { L"!p:late" },                            false, 0,      RETURNCODE_UNSATISFIED, 0 },
+   { { L"p:late & d:1s" },                      false, 0,      0,                      1000 },
+   { { L"p:db & !d:1s" },                       false, 0,      RETURNCODE_UNSATISFIED, 1000 },
+   { { L"!(p:db | p:cache) | d:30s" },          false, 0,      0,                      0 },
+   { { L"p:server & d:1s", L"!d:2s" },          false, 0,      1,                      0 },
+   { { L"d:5s & !d:10s", L"p:cache" },          true,  0,      RETURNCODE_UNSATISFIED, 10000 },
+   { { L"d:5s & !d:10s", L"p:cache" },          false, 0,      0,                      5000 },
+   { { L"!!p:db", L"d:1m" },                    false, 0,      0,                      5000 },
+   { { L"p:server" },                           false, 30000,  RETURNCODE_SIGINT,      30000 },
+   { { L"p:server" },                           false, 0,      RETURNCODE_ERROR,       0 },
+   { { L"p:db &" },                             false, 0,      RETURNCODE_PARSE,       0 },
+   { { L"(p:db" },                              false, 0,      RETURNCODE_PARSE,       0 }
+};
+
+void run_test_cases()
+{
+   for (size_t index = 0; index < sizeof(testCases) / sizeof(testCases[0]); index++)
+   {
+      const testCase& tc = testCases[index];
+      std::vector<std::wstring> operands;
+      for (size_t op = 0; op < sizeof(tc.operands) / sizeof(tc.operands[0]) && tc.operands[op]; op++)
+      {
+         operands.push_back( tc.operands[op] );
+      }
+
+      for (int port = 0; port < 2; port++)
+      {
+         sim_reset();
+         sim_script();
+         if (0 != tc.interrupt)
+         {
+            sim.interrupt = SIM_START + tc.interrupt * ONE_MILLISECOND;
+         }
+
+         int rc = sim_run(operands, tc.all, 0 != port);
+         ULONGLONG time = (sim.now - SIM_START) / ONE_MILLISECOND;
+         testCount++;
+         if (rc != tc.rc || (RETURNCODE_PARSE != rc && time != tc.time))
+         {
+            printf("FAILED: case %u%s: returned %d at %llu ms, expected %d at %llu ms\r\n",
+               static_cast<unsigned>(index), port ? " (port)" : "", rc, time, tc.rc, tc.time);
+            testFailures++;
+         }
+      }
+   }
+}
+
+// lock test case, the locks a and b are released by their owners at the times
+typedef struct lockCase {
+   const wchar_t* expression;
+   bool           hold;
+   ULONGLONG      timeA;
+   ULONGLONG      timeB;
+   int            rc;
+   const wchar_t* owned;
+} lockCase;
+
+const lockCase lockCases[] = {
+   { L"l:a | d:1s",                 true,  5000,      5000,      1,                      L"" },
+   { L"l:a & l:b",                  true,  1000,      2000,      0,                      L"a b " },
+   { L"l:a & l:b",                  false, 1000,      2000,      0,                      L"" },
+   { L"(l:a & p:server) | d:3s",    true,  1000,      5000,      1,                      L"" },
+   { L"l:a | l:b",                  true,  1000,      1000,      0,                      L"a " },
+   { L"l:b & !l:a",                 true,  SIM_NEVER, 1000,      0,                      L"b " },
+   { L"(l:a | d:2s) & l:b",         true,  1000,      3000,      0,                      L"a b " },
+   { L"d:2s & !l:a",                true,  1000,      5000,      RETURNCODE_UNSATISFIED, L"" }
+};
+
+void run_lock_tests()
+{
+   for (size_t index = 0; index < sizeof(lockCases) / sizeof(lockCases[0]); index++)
+   {
+      const lockCase& lc = lockCases[index];
+      for (int port = 0; port < 2; port++)
+      {
+         std::wstring owned;
+         sim_reset();
+         sim_script();
+         sim.locks.push_back( simLock(L"a", (SIM_NEVER == lc.timeA) ? SIM_NEVER : SIM_START + lc.timeA * ONE_MILLISECOND) );
+         sim.locks.push_back( simLock(L"b", (SIM_NEVER == lc.timeB) ? SIM_NEVER : SIM_START + lc.timeB * ONE_MILLISECOND) );
+
+         int rc = sim_run(std::vector<std::wstring>(1, lc.expression), false, 0 != port, lc.hold, &owned);
+         testCount++;
+         if (rc != lc.rc || owned != lc.owned)
+         {
+            printf("FAILED: lock case %u%s: returned %d with locks [%s], expected %d with locks [%s]\r\n",
+               static_cast<unsigned>(index), port ? " (port)" : "", rc, narrow(owned).c_str(), lc.rc, narrow(lc.owned).c_str());
+            testFailures++;
+         }
+      }
+   }
+}
+
+// running test case, make.exe processes exit at 1, 2 and 3 seconds, cmake.exe runs
+// forever, the late make.exe starts at 1.5 seconds and exits at 10 seconds, the reused
+// make.exe gets the id of the first one at 1.5 seconds and exits at 5 seconds
+typedef struct runningCase {
+   const wchar_t* expression;
+   bool           late;
+   bool           reused;
+   int            rc;
+   ULONGLONG      time;
+} runningCase;
+
+const runningCase runningCases[] = {
+   { L"r:make:2",                   false, false, 0,                      2000 },
+   { L"r:make.exe:2",               false, false, 0,                      2000 },
+   { L"r:MAKE:4",                   false, false, 0,                      0 },
+   { L"r:make:2",                   true,  false, 0,                      3000 },
+   { L"r:make:1",                   true,  false, 0,                      10000 },
+   { L"r:cmake:1",                  false, false, RETURNCODE_ERROR,       0 },
+   { L"r:make:1 | d:5s",            false, false, 0,                      3000 },
+   { L"r:make:1 | d:5s",            true,  false, 1,                      5000 },
+   { L"d:2500 & !r:make:2",         true,  false, 0,                      2500 },
+   { L"r:make:1",                   false, true,  0,                      5000 },
+   { L"r:make:1",                   true,  true,  0,                      10000 }
+};
+
+void run_running_tests()
+{
+   for (size_t index = 0; index < sizeof(runningCases) / sizeof(runningCases[0]); index++)
+   {
+      const runningCase& rc = runningCases[index];
+      for (int port = 0; port < 2; port++)
+      {
+         sim_reset();
+         sim.processes.push_back( simProcess(200, L"C:\\tools\\make.exe",  SIM_START - ONE_SECOND, SIM_START + 1 * ONE_SECOND) );
+         sim.processes.push_back( simProcess(201, L"C:\\tools\\cmake.exe", SIM_START - ONE_SECOND, SIM_NEVER) );
+         sim.processes.push_back( simProcess(202, L"C:\\tools\\make.exe",  SIM_START - ONE_SECOND, SIM_START + 2 * ONE_SECOND) );
+         sim.processes.push_back( simProcess(203, L"make.exe",               SIM_START - ONE_SECOND, SIM_START + 3 * ONE_SECOND) );
+         if (rc.late)
+         {
+            sim.processes.push_back( simProcess(204, L"C:\\tools\\make.exe", SIM_START + 1500 * ONE_MILLISECOND, SIM_START + 10 * ONE_SECOND) );
+         }
+         if (rc.reused)
+         {
+            sim.processes.push_back( simProcess(200, L"C:\\tools\\make.exe", SIM_START + 1500 * ONE_MILLISECOND, SIM_START + 5 * ONE_SECOND) );
+         }
+
+         int result = sim_run(std::vector<std::wstring>(1, rc.expression), false, 0 != port);
+         ULONGLONG time = (sim.now - SIM_START) / ONE_MILLISECOND;
+         testCount++;
+         if (result != rc.rc || (RETURNCODE_ERROR != result && time != rc.time))
+         {
+            printf("FAILED: running case %u%s: returned %d at %llu ms, expected %d at %llu ms\r\n",
+               static_cast<unsigned>(index), port ? " (port)" : "", result, time, rc.rc, rc.time);
+            testFailures++;
+         }
+      }
+   }
+}
+
+// signal test case, the signals waited as events occur at 1 second
+typedef struct signalCase {
+   const wchar_t* expression;
+   int            rc;
+   ULONGLONG      time;
+} signalCase;
+
+const signalCase signalCases[] = {
+   { L"s:int & d:2s",               0,                      2000 },
+   { L"s:close | d:1h",             0,                      1000 },
+   { L"s:close & d:1h",             RETURNCODE_CLOSE,       1000 },
+   { L"s:logoff & d:1h",            RETURNCODE_LOGOFF,      1000 },
+   { L"s:term & d:1h",              RETURNCODE_SHUTDOWN,    1000 },
+   { L"d:2s & !s:close",            RETURNCODE_UNSATISFIED, 1000 },
+   { L"s:myevent & d:2s",           0,                      2000 }
+};
+
+void run_signal_tests()
+{
+   for (size_t index = 0; index < sizeof(signalCases) / sizeof(signalCases[0]); index++)
+   {
+      const signalCase& sc = signalCases[index];
+      for (int port = 0; port < 2; port++)
+      {
+         sim_reset();
+         sim.signal = SIM_START + ONE_SECOND;
+
+         int rc = sim_run(std::vector<std::wstring>(1, sc.expression), false, 0 != port);
+         ULONGLONG time = (sim.now - SIM_START) / ONE_MILLISECOND;
+         testCount++;
+         if (rc != sc.rc || time != sc.time)
+         {
+            printf("FAILED: signal case %u%s: returned %d at %llu ms, expected %d at %llu ms\r\n",
+               static_cast<unsigned>(index), port ? " (port)" : "", rc, time, sc.rc, sc.time);
+            testFailures++;
+         }
+      }
+   }
+}
+
+void run_limit_tests()
+{
+   std::vector<std::wstring> operands;
+   for (int index = 1; index <= 100; index++)
+   {
+      wchar_t text[32];
+      _snwprintf(text, sizeof(text) / sizeof(text[0]), L"d:%d", 200 - index);
+      operands.push_back( text );
+   }
+
+   // the last operand has the shortest delta
+   sim_reset();
+   int rc = sim_run(operands, false, false);
+   testCount++;
+   if (99 != rc)
+   {
+      printf("FAILED: 100 events returned %d, expected 99\r\n", rc);
+      testFailures++;
+   }
+
+   operands.resize( 33 );
+   sim_reset();
+   sim.portAvailable = false;
+   rc = sim_run(operands, false, false);
+   testCount++;
+   if (-33 != rc)
+   {
+      printf("FAILED: 33 events without the port returned %d, expected -33\r\n", rc);
+      testFailures++;
+   }
+}
+
+// xorshift generator, so the scenarios are the same on every run
+ULONGLONG randomState = 88172645463325252ULL;
+
+size_t sim_random(size_t range)
+{
+   randomState ^= randomState << 13;
+   randomState ^= randomState >> 7;
+   randomState ^= randomState << 17;
+   return static_cast<size_t>(randomState % range);
+}
+
+// reference expression, evaluated from scratch after every event
+typedef struct refNode {
+   nodeType       type;
+   size_t         leaf;
+   indexVector    children;
+} refNode;
+
+typedef struct refLeaf {
+   std::wstring   text;
+   ULONGLONG      time;          // time when the event occurs
+   size_t         order;         // index of the engine event, the engine takes ties by it
+} refLeaf;
+
+typedef struct refScenario {
+   std::vector<refLeaf> leaves;
+   std::vector<refNode> nodes;
+   indexVector    operands;
+   bool           all;
+} refScenario;
+
+bool ref_value(const refScenario& sc, size_t index, const std::vector<bool>& occurred)
+{
+   const refNode& node = sc.nodes[index];
+   switch (node.type) {
+   case NODE_EVENT:
+      return occurred[ node.leaf ];
+   case NODE_NOT:
+      return !ref_value(sc, node.children.front(), occurred);
+   default:
+      for (indexVector::const_iterator it = node.children.begin(); it != node.children.end(); it++)
+      {
+         if (ref_value(sc, *it, occurred) == (NODE_OR == node.type))
+         {
+            return (NODE_OR == node.type);
+         }
+      }
+      return (NODE_AND == node.type);
+   }
+}
+
+// the state is decided when no future event can change the value
+nodeState ref_state(const refScenario& sc, size_t index, const std::vector<bool>& occurred)
+{
+   const refNode& node = sc.nodes[index];
+   switch (node.type) {
+   case NODE_EVENT:
+      return occurred[ node.leaf ] ? STATE_TRUE : STATE_PENDING;
+   case NODE_NOT:
+      switch (ref_state(sc, node.children.front(), occurred)) {
+      case STATE_TRUE:  return STATE_FALSE;
+      case STATE_FALSE: return STATE_TRUE;
+      default:          return STATE_PENDING;
+      }
+   default:
+      {
+         nodeState decider = (NODE_OR == node.type) ? STATE_TRUE : STATE_FALSE;
+         nodeState state = (NODE_OR == node.type) ? STATE_FALSE : STATE_TRUE;
+         for (indexVector::const_iterator it = node.children.begin(); it != node.children.end(); it++)
+         {
+            nodeState child = ref_state(sc, *it, occurred);
+            if (decider == child)
+            {
+               return decider;
+            }
+            if (STATE_PENDING == child)
+            {
+               state = STATE_PENDING;
+            }
+         }
+         return state;
+      }
+   }
+}
+
+int ref_result(const refScenario& sc, size_t root, const std::vector<bool>& occurred)
+{
+   const refNode& node = sc.nodes[root];
+   if (NODE_OR != node.type)
+   {
+      return 0;
+   }
+   int branch = 0;
+   while (!ref_value(sc, node.children[branch], occurred)) branch++;
+   return branch;
+}
+
+bool ref_order_less(const refLeaf* leaf1, const refLeaf* leaf2)
+{
+   return (leaf1->time != leaf2->time) ? (leaf1->time < leaf2->time) : (leaf1->order < leaf2->order);
+}
+
+// expected result and its time, the same tie rules as the engine: the expression true
+// only thanks to a negation waits for the events signaled at the same time, the
+// interruption loses the tie with the events
+int ref_run(const refScenario& sc, size_t root, ULONGLONG interrupt, ULONGLONG* time)
+{
+   std::vector<const refLeaf*> sequence;
+   for (std::vector<refLeaf>::const_iterator it = sc.leaves.begin(); it != sc.leaves.end(); it++)
+   {
+      if (NO_NODE != it->order && SIM_NEVER != it->time)
+      {
+         sequence.push_back( &(*it) );
+      }
+   }
+   std::sort(sequence.begin(), sequence.end(), ref_order_less);
+
+   std::vector<bool> occurred( sc.leaves.size(), false );
+   size_t next = 0;
+   *time = SIM_START;
+   for (;;)
+   {
+      nodeState state = ref_state(sc, root, occurred);
+      if (STATE_TRUE == state)
+      {
+         return ref_result(sc, root, occurred);
+      }
+      if (STATE_FALSE == state)
+      {
+         return RETURNCODE_UNSATISFIED;
+      }
+
+      ULONGLONG event = (next < sequence.size()) ? sequence[next]->time : SIM_NEVER;
+      if (ref_value(sc, root, occurred) && event > *time)
+      {
+         if (interrupt <= *time)
+         {
+            return RETURNCODE_SIGINT;
+         }
+         return ref_result(sc, root, occurred);
+      }
+      if (interrupt < event)
+      {
+         *time = interrupt;
+         return RETURNCODE_SIGINT;
+      }
+      if (SIM_NEVER == event)
+      {
+         return RETURNCODE_ERROR;
+      }
+      *time = event;
+      occurred[ sequence[next] - &sc.leaves[0] ] = true;
+      next++;
+   }
+}
+
+size_t ref_generate(refScenario& sc, int depth)
+{
+   refNode node;
+   size_t kind = sim_random(100);
+   if (0 == depth || kind < 40)
+   {
+      node.type = NODE_EVENT;
+      node.leaf = sim_random(sc.leaves.size());
+   }
+   else if (kind < 55)
+   {
+      node.type = NODE_NOT;
+      node.children.push_back( ref_generate(sc, depth - 1) );
+   }
+   else
+   {
+      node.type = (kind < 78) ? NODE_AND : NODE_OR;
+      for (size_t count = 2 + sim_random(3); count > 0; count--)
+      {
+         node.children.push_back( ref_generate(sc, depth - 1) );
+      }
+   }
+   sc.nodes.push_back( node );
+   return sc.nodes.size() - 1;
+}
+
+void ref_render(refScenario& sc, size_t index, std::wstring& text, size_t& events)
+{
+   const refNode& node = sc.nodes[index];
+   if (NODE_EVENT == node.type)
+   {
+      refLeaf& leaf = sc.leaves[ node.leaf ];
+      if (NO_NODE == leaf.order)
+      {
+         leaf.order = events++;
+      }
+      text += leaf.text;
+      return;
+   }
+
+   const wchar_t* op = (NODE_AND == node.type) ? L" & " : L" | ";
+   for (size_t child = 0; child < node.children.size(); child++)
+   {
+      const refNode& cnode = sc.nodes[ node.children[child] ];
+      bool group = (NODE_AND == cnode.type || NODE_OR == cnode.type);
+
+      text += (NODE_NOT == node.type) ? L"!" : ((0 == child) ? L"" : op);
+      if (group) text += L"(";
+      ref_render(sc, node.children[child], text, events);
+      if (group) text += L")";
+   }
+}
+
+// the leaves are delta timers and scripted processes: exiting, running forever,
+// started after the wait start or not existing at all
+void ref_leaves(refScenario& sc, std::set<ULONGLONG>& times)
+{
+   for (size_t count = 2 + sim_random(7); count > 0; count--)
+   {
+      refLeaf leaf;
+      wchar_t text[32];
+      ULONGLONG ms;
+      do
+      {
+         ms = 1 + sim_random(1000000);
+      }
+      while (!times.insert(ms).second);
+
+      leaf.order = NO_NODE;
+      leaf.time = SIM_START + ms * ONE_MILLISECOND;
+
+      size_t kind = sim_random(100);
+      if (kind < 40)
+      {
+         _snwprintf(text, sizeof(text) / sizeof(text[0]), L"d:%u", static_cast<unsigned>(ms));
+      }
+      else
+      {
+         DWORD id = static_cast<DWORD>(1000 + sc.leaves.size());
+         _snwprintf(text, sizeof(text) / sizeof(text[0]), L"p:%u", static_cast<unsigned>(id));
+         if (kind < 85)
+         {
+            sim.processes.push_back( simProcess(id, L"C:\\app\\job.exe", SIM_START - ONE_SECOND, leaf.time) );
+         }
+         else if (kind < 93)
+         {
+            sim.processes.push_back( simProcess(id, L"C:\\app\\job.exe", SIM_START - ONE_SECOND, SIM_NEVER) );
+            leaf.time = SIM_NEVER;
+         }
+         else
+         {
+            if (kind < 97)
+            {
+               sim.processes.push_back( simProcess(id, L"C:\\app\\job.exe", leaf.time, SIM_NEVER) );
+            }
+            // the process not found is treated as already exited
+            leaf.time = SIM_START;
+         }
+      }
+      text[ sizeof(text) / sizeof(text[0]) - 1 ] = 0;
+      leaf.text = text;
+      sc.leaves.push_back( leaf );
+   }
+}
+
+void run_random_tests(size_t scenarios)
+{
+   for (size_t index = 0; index < scenarios; index++)
+   {
+      refScenario sc;
+      std::set<ULONGLONG> times;
+      std::vector<std::wstring> operands;
+      size_t events = 0;
+
+      sim_reset();
+      ref_leaves(sc, times);
+      sc.all = (0 == sim_random(2));
+      for (size_t count = 1 + sim_random(3) / 2; count > 0; count--)
+      {
+         size_t node = ref_generate(sc, 1 + static_cast<int>(sim_random(4)));
+         std::wstring text;
+
+         // the operand itself is rendered as a child of the group
+         refNode group;
+         group.type = NODE_AND;
+         group.children.push_back( node );
+         sc.nodes.push_back( group );
+         ref_render(sc, sc.nodes.size() - 1, text, events);
+         sc.nodes.pop_back();
+
+         sc.operands.push_back( node );
+         operands.push_back( text );
+      }
+
+      size_t root = sc.operands.front();
+      if (sc.operands.size() > 1)
+      {
+         refNode node;
+         node.type = sc.all ? NODE_AND : NODE_OR;
+         node.children = sc.operands;
+         sc.nodes.push_back( node );
+         root = sc.nodes.size() - 1;
+      }
+
+      ULONGLONG interrupt = SIM_NEVER;
+      if (0 == sim_random(10))
+      {
+         ULONGLONG ms;
+         do
+         {
+            ms = 1 + sim_random(1000000);
+         }
+         while (!times.insert(ms).second);
+         interrupt = SIM_START + ms * ONE_MILLISECOND;
+      }
+
+      ULONGLONG expectedTime;
+      int expected = ref_run(sc, root, interrupt, &expectedTime);
+
+      bool port = (0 == sim_random(2));
+      sim.interrupt = interrupt;
+      int rc = sim_run(operands, sc.all, port);
+
+      for (std::vector<refLeaf>::iterator it = sc.leaves.begin(); it != sc.leaves.end(); it++)
+      {
+         if (NO_NODE != it->order && it->time <= sim.now) scriptedEvents++;
+      }
+
+      // the deadlock time depends on the events still registered
+      testCount++;
+      if (rc != expected || (RETURNCODE_ERROR != rc && sim.now != expectedTime))
+      {
+         std::string text;
+         for (std::vector<std::wstring>::iterator it = operands.begin(); it != operands.end(); it++)
+         {
+            text += " [" + narrow(*it) + "]";
+         }
+         printf("FAILED: scenario %u%s%s%s: returned %d at %llu ms, expected %d at %llu ms\r\n",
+            static_cast<unsigned>(index), text.c_str(), sc.all ? " all" : "", port ? " port" : "",
+            rc, (sim.now - SIM_START) / ONE_MILLISECOND, expected, (expectedTime - SIM_START) / ONE_MILLISECOND);
+         testFailures++;
+      }
+   }
+}
+
+// benchmark of the native engine: the setup is the time till the engine waits,
+// the latency is the time from signaling the last event till the engine returns
+typedef struct benchData {
+   LONGLONG       waitStart;
+   LONGLONG       signalTime;
+   HANDLE         ready;
+   HANDLE         trigger;
+} benchData;
+
+benchData bench;
+systemInterface benchSystem;
+
+void bench_waiting()
+{
+   if (0 == bench.waitStart)
+   {
+      bench.waitStart = profile_counter();
+      ::SetEvent( bench.ready );
+   }
+}
+
+DWORD bench_wait(DWORD count, const HANDLE* handles, DWORD timeout)
+{
+   bench_waiting();
+   return nativeSystem.wait(count, handles, timeout);
+}
+
+DWORD bench_port_wait(DWORD timeout)
+{
+   bench_waiting();
+   return nativeSystem.port_wait(timeout);
+}
+
+DWORD WINAPI bench_thread(LPVOID param)
+{
+   ::WaitForSingleObject( bench.ready, INFINITE );
+   
+   // the engine enters the wait
+   ::Sleep( 100 );
+   bench.signalTime = profile_counter();
+   ::SetEvent( bench.trigger );
+   return 0;
+}
+
+// count - number of events, the last one is a named signal, the others are named signals
+// or deadlines
+void run_benchmark(size_t count, bool deltas, bool port, double frequency)
+{
+   printf("%7u  %-6s  %-4s  ", static_cast<unsigned>(count), deltas ? "delta" : "signal", port ? "port" : "wfmo");
+   if (!port && count > 32)
+   {
+      printf("n/a (more than 32 events)\r\n");
+      return;
+   }
+
+   eventVector events;
+   nodeVector  nodes;
+   indexVector roots;
+   SYSTEMTIME  current;
+   wchar_t     text[64];
+
+   nativeSystem.get_local_time( &current );
+   for (size_t index = 0; index < count; index++)
+   {
+      if (deltas && index + 1 < count)
+      {
+         _snwprintf(text, sizeof(text) / sizeof(text[0]), L"d:%us", static_cast<unsigned>(3600 + index));
+      }
+      else
+      {
+         _snwprintf(text, sizeof(text) / sizeof(text[0]), L"s:wait_bench_%u_%u", 
+            static_cast<unsigned>(::GetCurrentProcessId()), static_cast<unsigned>(index));
+      }
+      text[ sizeof(text) / sizeof(text[0]) - 1 ] = 0;
+      roots.push_back( parse_expression(text, &current, events, nodes) );
+   }
+
+   // the engine opens the same named event
+   bench.trigger = ::CreateEventW(NULL, FALSE, FALSE, text + 2);
+   bench.ready = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+   bench.waitStart = 0;
+   HANDLE thread = ::CreateThread(NULL, 0, bench_thread, NULL, 0, NULL);
+   if (NULL == bench.trigger || NULL == bench.ready || NULL == thread)
+   {
+      printf("failed to start\r\n");
+      return;
+   }
+
+   waitOptions options = { true, false, port };
+   LONGLONG start = profile_counter();
+   int rc = run_engine(benchSystem, events, nodes, link_operands(nodes, roots, false), options);
+   LONGLONG end = profile_counter();
+   close_events(benchSystem, events);
+
+   // the thread waits for the engine even if it fails
+   ::SetEvent( bench.ready );
+   ::WaitForSingleObject( thread, INFINITE );
+   ::CloseHandle( thread );
+   ::CloseHandle( bench.ready );
+   ::CloseHandle( bench.trigger );
+
+   if (static_cast<int>(count) - 1 != rc)
+   {
+      printf("failed (%d)\r\n", rc);
+      return;
+   }
+   printf("%10.2f  %10.1f\r\n", (bench.waitStart - start) * 1000.0 / frequency, (end - bench.signalTime) * 1000000.0 / frequency);
+}
+
+void run_benchmarks()
+{
+   LARGE_INTEGER frequency;
+   if (!::QueryPerformanceFrequency( &frequency ) || 0 == frequency.QuadPart)
+   {
+      printf("performance counter is not available\r\n");
+      return;
+   }
+
+   benchSystem = nativeSystem;
+   benchSystem.wait = bench_wait;
+   benchSystem.port_wait = bench_port_wait;
+
+   const size_t counts[] = { 10, 1000, 100000 };
+   printf(" events  kind    wait  setup (ms)  latency (us)\r\n");
+   for (size_t index = 0; index < sizeof(counts) / sizeof(counts[0]); index++)
+   {
+      for (int deltas = 0; deltas < 2; deltas++)
+      {
+         run_benchmark(counts[index], 0 != deltas, false, static_cast<double>(frequency.QuadPart));
+         run_benchmark(counts[index], 0 != deltas, true, static_cast<double>(frequency.QuadPart));
+      }
+   }
+}
+
+int wmain(int argc, wchar_t *argv[])
+{
+   size_t scenarios = RANDOM_SCENARIOS;
+   if (argc > 1)
+   {
+      if (0 == _wcsicmp(argv[1], L"--bench"))
+      {
+         run_benchmarks();
+         return 0;
+      }
+      scenarios = wcstoul(argv[1], NULL, 10);
+   }
+
+   run_test_cases();
+   run_lock_tests();
+   run_running_tests();
+   run_signal_tests();
+   run_limit_tests();
+   run_random_tests(scenarios);
+
+   printf("%u tests, %u failed, %llu scripted events\r\n",
+      static_cast<unsigned>(testCount), static_cast<unsigned>(testFailures), scriptedEvents);
+   return (0 == testFailures) ? 0 : 1;
+}